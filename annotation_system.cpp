@@ -3,9 +3,205 @@
 #include "stdafx.h"
 #include "fileIO_helpers.h"
 #include "timer_ticToc.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <cctype>
+#include <list>
+#include <future>
+#include <set>
+#ifdef _WIN32
+#include <io.h> // _commit
+#else
+#include <unistd.h> // fsync
+#endif
 
 using namespace std; // for standard C++ lib
 
+// a mouse event as passed to the highgui mouse callbacks
+struct mouseEvent
+{
+	// pseudo events: a trackbar change, x holding the new position, and a
+	// key acted on (e.g. undo in manipRect), x holding the key code
+	enum { EVENT_TRACKBAR = -1, EVENT_KEY = -2 };
+	int event, x, y, flags;
+};
+
+// mapping between image coordinates and the coordinates of the image as
+// displayed, which is the image scaled by a single factor. The display
+// image is made once per image (cv::resize with INTER_AREA when shrinking)
+// into a buffer that is reused from image to image, so drawing and showing
+// cost in proportion to the screen rather than to the sensor. Points and
+// rectangle corners are mapped with a single rounding, so a rectangle
+// stored in image coordinates is drawn on the same display pixels however
+// often it is redrawn.
+class viewTransform
+{
+public:
+
+	viewTransform() : scale(1), size_max(0, 0) {}
+
+	// a fixed scale: display pixels per image pixel
+	void set_scale(double scale_)
+	{
+		scale = scale_ > 0 ? scale_ : 1;
+		size_max = cv::Size(0, 0);
+	}
+
+	// a scale chosen for each image so that it fits in size_max_ (images
+	// that already fit are shown at full resolution)
+	void set_fit(const cv::Size &size_max_) { size_max = size_max_; }
+
+	// set the scale for img and make its display image
+	void set_image(const cv::Mat &img)
+	{
+		if (size_max.area() > 0)
+			scale = std::min(1.0, std::min(static_cast<double>(size_max.width) / img.cols,
+				static_cast<double>(size_max.height) / img.rows));
+		if (scale == 1)
+		{
+			img_disp = img; // no copy; the canvases are copied from it
+			return;
+		}
+		cv::Size size_disp(std::max(1, static_cast<int>(std::round(img.cols * scale))),
+			std::max(1, static_cast<int>(std::round(img.rows * scale))));
+		cv::resize(img, img_disp_buf, size_disp, 0, 0, scale < 1 ? cv::INTER_AREA : cv::INTER_LINEAR);
+		img_disp = img_disp_buf;
+	}
+
+	const cv::Mat& get_img_disp() const { return img_disp; }
+	double get_scale() const { return scale; }
+
+	cv::Point to_img(const cv::Point &p) const
+	{
+		if (scale == 1) return p;
+		return cv::Point(static_cast<int>(std::round(p.x / scale)), static_cast<int>(std::round(p.y / scale)));
+	}
+
+	cv::Point to_disp(const cv::Point &p) const
+	{
+		if (scale == 1) return p;
+		return cv::Point(static_cast<int>(std::round(p.x * scale)), static_cast<int>(std::round(p.y * scale)));
+	}
+
+	cv::Rect to_img(const cv::Rect &r) const { return cv::Rect(to_img(r.tl()), to_img(r.br())); }
+	cv::Rect to_disp(const cv::Rect &r) const { return cv::Rect(to_disp(r.tl()), to_disp(r.br())); }
+
+private:
+	double scale;
+	cv::Size size_max; // (0, 0) for a fixed scale
+	cv::Mat img_disp, img_disp_buf;
+};
+
+// timings of the stages of an annotation session (decoding, user
+// interaction, patch extraction, writing, ...), recorded from any thread.
+// Each record is a stage name, an id (the index of the image, or the number
+// of the patch for "write"), the start relative to the creation of the
+// trace and the duration. Recording takes a clock read and a short locked
+// push_back, so it can stay on in normal sessions. Stage names must be
+// string literals (they are stored as pointers).
+class latencyTrace
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	latencyTrace() : t0(clock::now()) { entries.reserve(4096); }
+
+	void add(const char *stage, long long id, clock::time_point t_start, clock::time_point t_end)
+	{
+		entry e{ stage, id, ms_between(t0, t_start), ms_between(t_start, t_end) };
+		std::lock_guard<std::mutex> lock(mtx);
+		entries.push_back(e);
+	}
+
+	// times its own lifetime; does nothing if trace is nullptr
+	class scope
+	{
+	public:
+		scope(latencyTrace *trace_, const char *stage_, long long id_) : trace(trace_), stage(stage_), id(id_)
+		{
+			if (trace) t_start = clock::now();
+		}
+		~scope() { if (trace) trace->add(stage, id, t_start, clock::now()); }
+	private:
+		latencyTrace *trace;
+		const char *stage;
+		long long id;
+		clock::time_point t_start;
+	};
+
+	// one line per record: stage,id,start_ms,ms
+	void save_csv(const std::string &fpath) const
+	{
+		std::ofstream fs(fpath);
+		if (!fs.is_open())
+		{
+			printf("ERROR: could not create %s\n", fpath.c_str());
+			throw std::runtime_error("");
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		fs << "stage,id,start_ms,ms\n";
+		for (size_t i = 0; i < entries.size(); i++)
+			fs << entries[i].stage << ',' << entries[i].id << ',' << entries[i].t_start_ms << ',' << entries[i].ms << '\n';
+	}
+
+	// count, mean, 50th/90th/99th percentiles and max of every stage, in ms
+	void print_summary() const
+	{
+		std::map<std::string, std::vector<double>> per_stage;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			for (size_t i = 0; i < entries.size(); i++)
+				per_stage[entries[i].stage].push_back(entries[i].ms);
+		}
+		printf("%-16s %8s %10s %10s %10s %10s %10s\n", "stage", "count", "mean", "p50", "p90", "p99", "max");
+		for (std::map<std::string, std::vector<double>>::iterator it = per_stage.begin(); it != per_stage.end(); ++it)
+		{
+			std::vector<double> &ms = it->second;
+			std::sort(ms.begin(), ms.end());
+			double sum = 0;
+			for (size_t i = 0; i < ms.size(); i++) sum += ms[i];
+			printf("%-16s %8d %10.2f %10.2f %10.2f %10.2f %10.2f\n", it->first.c_str(), static_cast<int>(ms.size()),
+				sum / ms.size(), percentile(ms, 50), percentile(ms, 90), percentile(ms, 99), ms.back());
+		}
+	}
+
+	// nearest rank, of sorted values
+	static double percentile(const std::vector<double> &sorted, double pct)
+	{
+		size_t rank = static_cast<size_t>(std::ceil(pct / 100 * sorted.size()));
+		return sorted[std::min(std::max(rank, size_t(1)), sorted.size()) - 1];
+	}
+
+private:
+	struct entry { const char *stage; long long id; double t_start_ms; double ms; };
+
+	clock::time_point t0;
+	mutable std::mutex mtx;
+	std::vector<entry> entries;
+
+	static double ms_between(clock::time_point a, clock::time_point b)
+	{
+		return std::chrono::duration<double, std::milli>(b - a).count();
+	}
+};
+
+class annotationJournal;
+class tileReader;
+
 // abstract class for getting rectangles from user
 // this is useful for annotation datasets for image
 // recognition, object detection, etc.
@@ -15,10 +211,309 @@ using namespace std; // for standard C++ lib
 class getRect_user
 {
 public:
+	getRect_user() : headless(false), record_events(false), trace(nullptr), id_trace(0), first_rect_traced(true), n_rects_start(0) {}
 	virtual ~getRect_user() {};
 	// for a given image, get the rectangles
 	virtual std::vector<cv::Rect> get_dr(const cv::Mat &img) = 0;
+
+	// same, starting from the rectangles dr_init (e.g. proposed by a
+	// preAnnotator) for the user to correct. Implementations that cannot
+	// edit existing rectangles ignore dr_init.
+	virtual std::vector<cv::Rect> get_dr(const cv::Mat &img, const std::vector<cv::Rect> & /*dr_init*/) { return get_dr(img); }
+
+	// same, for an image read region by region (e.g. a Deep Zoom pyramid
+	// too large to decode in full). Only getRect_tiled reads just what it
+	// shows; the others are given the whole image, read here.
+	virtual std::vector<cv::Rect> get_dr(tileReader &reader, const std::vector<cv::Rect> &dr_init);
+
+	// The following allow an implementation to be driven without a window
+	// (see getRect_replay). reset() prepares the state for a new image the
+	// same way get_dr() does, feed_event() passes a mouse event to the same
+	// callback that highgui would call, and get_dr_current() returns the
+	// rectangles obtained so far.
+	virtual void reset(const cv::Mat &img) = 0;
+	virtual void reset(const cv::Mat &img, const std::vector<cv::Rect> & /*dr_init*/) { reset(img); }
+	virtual void feed_event(int event, int x, int y, int flags) = 0;
+	virtual std::vector<cv::Rect> get_dr_current() = 0;
+
+	// if true, nothing is displayed, so that no window (or display) is needed
+	void set_headless(bool headless_) { headless = headless_; }
+
+	// if true, the mouse events received for the current image are recorded
+	// so that they can later be replayed with getRect_replay
+	void set_record_events(bool record_events_) { record_events = record_events_; }
+	const std::vector<mouseEvent>& get_events_recorded() const { return events_recorded; }
+
+	// Display the image scaled by a fixed factor, or scaled down to fit in
+	// size_max_. Mouse events are then in display coordinates, while the
+	// rectangles obtained are always in image coordinates.
+	void set_display_scale(double scale_) { view.set_scale(scale_); }
+	void set_display_fit(const cv::Size &size_max_) { view.set_fit(size_max_); }
+
+	// record every edit made to the rectangles into journal_ (nullptr for
+	// none), for implementations that edit them one at a time (manipRect)
+	virtual void set_journal(annotationJournal * /*journal_*/) {}
+
+	// record into trace_ (nullptr for none), under id id_, the time from a
+	// mouse event to its rendering ("render") and, once, the time from this
+	// call to the first rectangle added beyond the n_rects_start_ there
+	// already are ("first_rect"). To be called right before get_dr().
+	void trace_image(latencyTrace *trace_, long long id_, size_t n_rects_start_ = 0)
+	{
+		trace = trace_;
+		id_trace = id_;
+		first_rect_traced = trace == nullptr;
+		n_rects_start = n_rects_start_;
+		t_start_trace = latencyTrace::clock::now();
+	}
+
 protected:
+	bool headless;
+	bool record_events;
+	std::vector<mouseEvent> events_recorded;
+	viewTransform view; // image <-> display coordinates
+
+	// to be called at the beginning of every mouse callback
+	void record_event(int event, int x, int y, int flags)
+	{
+		if (trace) t_event = latencyTrace::clock::now();
+		if (record_events)
+			events_recorded.push_back(mouseEvent{ event, x, y, flags });
+	}
+
+	// to be used instead of cv::imshow in the mouse callbacks
+	void show(const std::string &name_win, const cv::Mat &img)
+	{
+		if (!headless)
+			cv::imshow(name_win, img);
+		if (trace)
+		{
+			latencyTrace::clock::time_point t_shown = latencyTrace::clock::now();
+			trace->add("render", id_trace, t_event, t_shown);
+			if (!first_rect_traced && get_dr_current().size() > n_rects_start)
+			{
+				trace->add("first_rect", id_trace, t_start_trace, t_shown);
+				first_rect_traced = true;
+			}
+		}
+	}
+
+private:
+	latencyTrace *trace;
+	long long id_trace;
+	bool first_rect_traced;
+	size_t n_rects_start;
+	latencyTrace::clock::time_point t_start_trace, t_event;
+};
+
+// draws temporary shapes (rubber-band rectangles, markers) on top of a
+// canvas without copying the whole canvas: only the thin strips of pixels
+// that a shape covers are saved before drawing, and restore() puts them
+// back. The buffers only ever grow, so once warmed up no memory is
+// allocated per mouse event. Typical use on a mouse move:
+//     overlay.draw_rect(canvas, ...); show(canvas); overlay.restore(canvas);
+// (cv::imshow copies the image, so it can be restored right after showing.)
+class overlayCanvas
+{
+public:
+
+	overlayCanvas() : n_saved(0) {}
+
+	// same arguments as cv::rectangle with two corner points
+	void draw_rect(cv::Mat &canvas, const cv::Point &pt1, const cv::Point &pt2,
+		const cv::Scalar &color, int thickness)
+	{
+		int pad = thickness / 2 + 2;
+		int band = 2 * pad + 1;
+		cv::Rect box(std::min(pt1.x, pt2.x) - pad, std::min(pt1.y, pt2.y) - pad,
+			std::abs(pt2.x - pt1.x) + band, std::abs(pt2.y - pt1.y) + band);
+		save(canvas, cv::Rect(box.x, box.y, box.width, band)); // top
+		save(canvas, cv::Rect(box.x, box.y + box.height - band, box.width, band)); // bottom
+		save(canvas, cv::Rect(box.x, box.y, band, box.height)); // left
+		save(canvas, cv::Rect(box.x + box.width - band, box.y, band, box.height)); // right
+		cv::rectangle(canvas, pt1, pt2, color, thickness);
+	}
+
+	// same arguments as cv::rectangle with a cv::Rect
+	void draw_rect(cv::Mat &canvas, const cv::Rect &rec, const cv::Scalar &color, int thickness)
+	{
+		draw_rect(canvas, rec.tl(), rec.br() - cv::Point(1, 1), color, thickness);
+	}
+
+	// same arguments as cv::drawMarker
+	void draw_marker(cv::Mat &canvas, const cv::Point &position, const cv::Scalar &color,
+		int markerType = cv::MARKER_CROSS, int markerSize = 20, int thickness = 1, int line_type = 8)
+	{
+		int half = markerSize / 2 + thickness + 2;
+		save(canvas, cv::Rect(position.x - half, position.y - half, 2 * half + 1, 2 * half + 1));
+		cv::drawMarker(canvas, position, color, markerType, markerSize, thickness, line_type);
+	}
+
+	// put back the pixels under everything drawn since the last restore
+	void restore(cv::Mat &canvas)
+	{
+		// in reverse, although every slot holds pixels saved before any drawing
+		for (int k = n_saved - 1; k >= 0; k--)
+		{
+			cv::Mat dst = canvas(regions[k]);
+			bufs[k](cv::Rect(0, 0, regions[k].width, regions[k].height)).copyTo(dst);
+		}
+		n_saved = 0;
+	}
+
+private:
+
+	static const int max_saved = 8;
+	cv::Mat bufs[max_saved];
+	cv::Rect regions[max_saved];
+	int n_saved;
+
+	void save(const cv::Mat &canvas, cv::Rect region)
+	{
+		region &= cv::Rect(0, 0, canvas.cols, canvas.rows);
+		if (region.area() <= 0) return;
+		if (n_saved == max_saved)
+		{
+			printf("ERROR: overlayCanvas can only hold %d regions; call restore() first\n", max_saved);
+			throw std::runtime_error("");
+		}
+		cv::Mat &buf = bufs[n_saved];
+		if (buf.rows < region.height || buf.cols < region.width || buf.type() != canvas.type())
+			buf.create(std::max(buf.rows, region.height), std::max(buf.cols, region.width), canvas.type());
+		cv::Mat dst = buf(cv::Rect(0, 0, region.width, region.height));
+		canvas(region).copyTo(dst);
+		regions[n_saved] = region;
+		n_saved++;
+	}
+};
+
+// uniform grid over the centres of a vector of rectangles, kept in sync
+// with the vector by its owner (insert/remove/relabel). Answers nearest
+// centre, centres inside a box and rectangles overlapping a region by
+// looking only at the cells involved instead of every rectangle. Centres
+// outside the image are kept in the border cells.
+class rectGrid
+{
+public:
+
+	rectGrid() : cell_size(64), n_cols(0), n_rows(0), max_w(0), max_h(0) {}
+
+	// clear the grid and size it for an image of size_img
+	void reset(const cv::Size &size_img, int cell_size_ = 64)
+	{
+		cell_size = std::max(cell_size_, 1);
+		n_cols = std::max((size_img.width + cell_size - 1) / cell_size, 1);
+		n_rows = std::max((size_img.height + cell_size - 1) / cell_size, 1);
+		cells.assign(n_cols * n_rows, std::vector<int>());
+		max_w = max_h = 0;
+	}
+
+	// rectangle r has been added under index id
+	void insert(int id, const cv::Rect &r)
+	{
+		cell_at(centre(r)).push_back(id);
+		max_w = std::max(max_w, r.width);
+		max_h = std::max(max_h, r.height);
+	}
+
+	// rectangle r with index id has been removed
+	void remove(int id, const cv::Rect &r)
+	{
+		std::vector<int> &cell = cell_at(centre(r));
+		std::vector<int>::iterator it = std::find(cell.begin(), cell.end(), id);
+		if (it == cell.end()) return;
+		*it = cell.back();
+		cell.pop_back();
+	}
+
+	// rectangle r, previously at index id_old, is now at index id_new
+	void relabel(int id_old, int id_new, const cv::Rect &r)
+	{
+		std::vector<int> &cell = cell_at(centre(r));
+		std::vector<int>::iterator it = std::find(cell.begin(), cell.end(), id_old);
+		if (it != cell.end()) *it = id_new;
+	}
+
+	// index of the rectangle in dr whose centre is nearest to p; -1 if there are none
+	int nearest(const cv::Point &p, const std::vector<cv::Rect> &dr) const
+	{
+		int cx = cell_x(p.x), cy = cell_y(p.y);
+		int idx_best = -1;
+		long long d2_best = 0;
+		int r_max = std::max(n_cols, n_rows);
+		for (int r = 0; r <= r_max; r++)
+		{
+			// visit the ring of cells at Chebyshev distance r from (cx, cy)
+			for (int j = cy - r; j <= cy + r; j++)
+			{
+				if (j < 0 || j >= n_rows) continue;
+				int step = (j == cy - r || j == cy + r) ? 1 : 2 * r;
+				for (int i = cx - r; i <= cx + r; i += std::max(step, 1))
+				{
+					if (i < 0 || i >= n_cols) continue;
+					const std::vector<int> &cell = cells[j * n_cols + i];
+					for (size_t k = 0; k < cell.size(); k++)
+					{
+						cv::Point c = centre(dr[cell[k]]);
+						long long dx = c.x - p.x, dy = c.y - p.y;
+						long long d2 = dx * dx + dy * dy;
+						if (idx_best < 0 || d2 < d2_best)
+						{
+							idx_best = cell[k];
+							d2_best = d2;
+						}
+					}
+				}
+			}
+			// every cell further out is at least r cells away
+			long long d_min = static_cast<long long>(r) * cell_size;
+			if (idx_best >= 0 && d2_best <= d_min * d_min) break;
+		}
+		return idx_best;
+	}
+
+	// indices of the rectangles in dr whose centres lie inside box
+	void query_centres(const cv::Rect &box, const std::vector<cv::Rect> &dr, std::vector<int> &ids) const
+	{
+		ids.clear();
+		if (box.width <= 0 || box.height <= 0) return;
+		for (int j = cell_y(box.y); j <= cell_y(box.y + box.height - 1); j++)
+			for (int i = cell_x(box.x); i <= cell_x(box.x + box.width - 1); i++)
+			{
+				const std::vector<int> &cell = cells[j * n_cols + i];
+				for (size_t k = 0; k < cell.size(); k++)
+					if (box.contains(centre(dr[cell[k]])))
+						ids.push_back(cell[k]);
+			}
+	}
+
+	// indices of the rectangles indexed that may overlap region (a superset;
+	// the caller does the exact test)
+	void query_overlap(const cv::Rect &region, std::vector<int> &ids) const
+	{
+		ids.clear();
+		cv::Rect box(region.x - max_w / 2 - 1, region.y - max_h / 2 - 1,
+			region.width + max_w + 2, region.height + max_h + 2);
+		for (int j = cell_y(box.y); j <= cell_y(box.y + box.height - 1); j++)
+			for (int i = cell_x(box.x); i <= cell_x(box.x + box.width - 1); i++)
+			{
+				const std::vector<int> &cell = cells[j * n_cols + i];
+				ids.insert(ids.end(), cell.begin(), cell.end());
+			}
+	}
+
+	// same definition of the centre as used for deleting rectangles
+	static cv::Point centre(const cv::Rect &r) { return cv::Point(r.x + r.width / 2, r.y + r.height / 2); }
+
+private:
+
+	int cell_size, n_cols, n_rows;
+	std::vector<std::vector<int>> cells; // row major, n_rows x n_cols
+	int max_w, max_h; // largest rectangle inserted since reset
+
+	int cell_x(int x) const { return x < 0 ? 0 : std::min(x / cell_size, n_cols - 1); }
+	int cell_y(int y) const { return y < 0 ? 0 : std::min(y / cell_size, n_rows - 1); }
+	std::vector<int>& cell_at(const cv::Point &p) { return cells[cell_y(p.y) * n_cols + cell_x(p.x)]; }
 };
 
 // get a rectangle by one click at the top left corner
@@ -44,16 +539,26 @@ public:
 
 	std::vector<cv::Rect> get_dr(const cv::Mat &img) override
 	{ 
-		dr.clear(); dr.reserve(30);
-		being_dragged = false;
-		img_canvas = img.clone();
+		reset(img);
 		cv::namedWindow(name_win);
-		cv::imshow(name_win, img);
+		cv::imshow(name_win, img_canvas);
 		cv::setMouseCallback(name_win, CallBackFunc, this);
 		cv::waitKey(0);
 		return dr; 
 	}
 
+	void reset(const cv::Mat &img) override
+	{
+		dr.clear(); dr.reserve(30);
+		being_dragged = false;
+		view.set_image(img);
+		view.get_img_disp().copyTo(img_canvas);
+		events_recorded.clear();
+	}
+
+	void feed_event(int event, int x, int y, int flags) override { CallBackFunc(event, x, y, flags, this); }
+	std::vector<cv::Rect> get_dr_current() override { return dr; }
+
 	cv::Mat get_img_drawn() { return img_canvas; }
 
 	//==========================================//
@@ -64,38 +569,42 @@ public:
 	cv::Scalar color_rect;
 	std::vector<cv::Rect> dr;
 	cv::Mat img_canvas;
+	overlayCanvas overlay; // for the rectangle being dragged
 	bool being_dragged;
-	cv::Point point1, point2;
+	cv::Point point1, point2; // image coordinates
 
 private:
 
 	static void CallBackFunc(int event, int x, int y, int flags, void* userdata)
 	{
 		getRect_1click_drag* thisObj = static_cast<getRect_1click_drag*>(userdata);
+		thisObj->record_event(event, x, y, flags);
+		cv::Point p_img = thisObj->view.to_img(cv::Point(x, y));
 
 		if (event == CV_EVENT_LBUTTONDOWN && !thisObj->being_dragged)
 		{
 			/* left button clicked. ROI selection begins */
-			thisObj->point1 = cv::Point(x, y);
+			thisObj->point1 = p_img;
 			thisObj->being_dragged = true;
 		}
 
 		if (event == CV_EVENT_MOUSEMOVE && thisObj->being_dragged)
 		{
 			/* mouse dragged. ROI being selected */
-			cv::Mat img_temp = thisObj->img_canvas.clone();
-			thisObj->point2 = cv::Point(x, y);
-			cv::rectangle(img_temp, thisObj->point1, thisObj->point2, thisObj->color_rect, thisObj->thickness_rect);
-			cv::imshow(thisObj->name_win, img_temp);
+			thisObj->point2 = p_img;
+			thisObj->overlay.draw_rect(thisObj->img_canvas, thisObj->view.to_disp(thisObj->point1), cv::Point(x, y), thisObj->color_rect, thisObj->thickness_rect);
+			thisObj->show(thisObj->name_win, thisObj->img_canvas);
+			thisObj->overlay.restore(thisObj->img_canvas);
 		}
 
 		if (event == CV_EVENT_LBUTTONUP && thisObj->being_dragged)
 		{
-			thisObj->point2 = cv::Point(x, y);
+			thisObj->point2 = p_img;
 			thisObj->being_dragged = false;
-			cv::rectangle(thisObj->img_canvas, thisObj->point1, thisObj->point2, thisObj->color_rect, thisObj->thickness_rect);
-			cv::imshow(thisObj->name_win, thisObj->img_canvas);
-			thisObj->dr.push_back(cv::Rect(thisObj->point1, thisObj->point2));			
+			cv::Rect rect_cur(thisObj->point1, thisObj->point2);
+			cv::rectangle(thisObj->img_canvas, thisObj->view.to_disp(rect_cur), thisObj->color_rect, thisObj->thickness_rect);
+			thisObj->show(thisObj->name_win, thisObj->img_canvas);
+			thisObj->dr.push_back(rect_cur);
 		}
 	}
 };
@@ -147,16 +656,26 @@ public:
 
 	std::vector<cv::Rect> get_dr(const cv::Mat &img)  override
 	{ 
-		firstClickDone = false;
-		img_canvas = img.clone();
-		dr.clear(); dr.reserve(30);
+		reset(img);
 		cv::namedWindow(name_win);
-		cv::imshow(name_win, img);
+		cv::imshow(name_win, img_canvas);
 		cv::setMouseCallback(name_win, CallBackFunc, this);
 		cv::waitKey(0);
 		return dr; 
 	}
 
+	void reset(const cv::Mat &img) override
+	{
+		firstClickDone = false;
+		view.set_image(img);
+		view.get_img_disp().copyTo(img_canvas);
+		dr.clear(); dr.reserve(30);
+		events_recorded.clear();
+	}
+
+	void feed_event(int event, int x, int y, int flags) override { CallBackFunc(event, x, y, flags, this); }
+	std::vector<cv::Rect> get_dr_current() override { return dr; }
+
 	cv::Mat get_img_drawn() { return img_canvas; }
 
 	//==========================================//
@@ -167,7 +686,8 @@ public:
 	cv::Scalar color_rect;
 	std::vector<cv::Rect> dr;
 	cv::Mat img_canvas;
-	cv::Point point1, point2;
+	overlayCanvas overlay; // for the first click marker
+	cv::Point point1, point2; // image coordinates
 	bool firstClickDone;
 	ModeClicks mode_click;
 	float aspect_ratio;
@@ -177,13 +697,15 @@ private:
 	static void CallBackFunc(int event, int x, int y, int flags, void* userdata)
 	{
 		getRect_2clicks* thisObj = static_cast<getRect_2clicks*>(userdata);
+		thisObj->record_event(event, x, y, flags);
+		cv::Point p_img = thisObj->view.to_img(cv::Point(x, y));
 		
 		if (event == CV_EVENT_LBUTTONUP)
 		{
 			// process second click: got a rectangle; display & save it
 			if (thisObj->firstClickDone) 
 			{
-				thisObj->point2 = cv::Point(x, y);
+				thisObj->point2 = p_img;
 				cv::Rect rect_cur;
 				
 				switch (thisObj->mode_click)
@@ -283,8 +805,8 @@ private:
 
 				} // end switch		
 
-				cv::rectangle(thisObj->img_canvas, rect_cur, thisObj->color_rect, thisObj->thickness_rect);
-				cv::imshow(thisObj->name_win, thisObj->img_canvas);
+				cv::rectangle(thisObj->img_canvas, thisObj->view.to_disp(rect_cur), thisObj->color_rect, thisObj->thickness_rect);
+				thisObj->show(thisObj->name_win, thisObj->img_canvas);
 				thisObj->dr.push_back(rect_cur);
 				thisObj->firstClickDone = false;
 			}
@@ -293,10 +815,10 @@ private:
 			// wait for the second click to form the rectangle
 			else
 			{
-				thisObj->point1 = cv::Point(x, y);
-				cv::Mat img_temp = thisObj->img_canvas.clone();
-				cv::drawMarker(img_temp, thisObj->point1, thisObj->color_rect, 0, 20, 2, 8);
-				cv::imshow(thisObj->name_win, img_temp);
+				thisObj->point1 = p_img;
+				thisObj->overlay.draw_marker(thisObj->img_canvas, cv::Point(x, y), thisObj->color_rect, 0, 20, 2, 8);
+				thisObj->show(thisObj->name_win, thisObj->img_canvas);
+				thisObj->overlay.restore(thisObj->img_canvas);
 				thisObj->firstClickDone = true;
 			}			
 		}
@@ -344,17 +866,26 @@ public:
 
 	std::vector<cv::Rect> get_dr(const cv::Mat &img)  override
 	{ 
-		img_canvas = img.clone();
-		dr.clear(); dr.reserve(30);
-		points_marked.clear(); points_marked.reserve(30);
-
+		reset(img);
 		cv::namedWindow(name_win);
-		cv::imshow(name_win, img);
+		cv::imshow(name_win, img_canvas);
 		cv::setMouseCallback(name_win, CallBackFunc, this);
 		cv::waitKey(0);
 		return dr; 
 	}
 
+	void reset(const cv::Mat &img) override
+	{
+		view.set_image(img);
+		view.get_img_disp().copyTo(img_canvas);
+		dr.clear(); dr.reserve(30);
+		points_marked.clear(); points_marked.reserve(30);
+		events_recorded.clear();
+	}
+
+	void feed_event(int event, int x, int y, int flags) override { CallBackFunc(event, x, y, flags, this); }
+	std::vector<cv::Rect> get_dr_current() override { return dr; }
+
 	std::vector<cv::Point> get_points() { return points_marked; }
 	cv::Mat get_img_drawn() { return img_canvas; }
 
@@ -368,9 +899,9 @@ public:
 	int thickness;
 	cv::Scalar color;
 	std::vector<cv::Rect> dr; // recorded rectangles
-	std::vector<cv::Point> points_marked; // recorded points
+	std::vector<cv::Point> points_marked; // recorded points, image coordinates
 
-	// for drawing fixed size rectangle with the point
+	// for drawing fixed size rectangle with the point (image coordinates)
 	cv::Size rectSize;
 
 	// for drawing fixed size cross mark with the point
@@ -383,19 +914,20 @@ private:
 	static void CallBackFunc(int event, int x, int y, int flags, void* userdata)
 	{
 		getRect_1click* thisObj = static_cast<getRect_1click*>(userdata);
+		thisObj->record_event(event, x, y, flags);
 
 		if (event == CV_EVENT_LBUTTONUP)
 		{
-			cv::Point point_cur = cv::Point(x, y);
+			cv::Point point_cur = thisObj->view.to_img(cv::Point(x, y));
 			cv::Rect rect_cur = cv::Rect(point_cur, thisObj->rectSize);
 			// rect_cur is such that the point_cur is at its center
 			rect_cur -= cv::Point(thisObj->rectSize / 2); 
 			if (thisObj->draw_rect_mode)
-				cv::rectangle(thisObj->img_canvas, rect_cur, thisObj->color, thisObj->thickness);
+				cv::rectangle(thisObj->img_canvas, thisObj->view.to_disp(rect_cur), thisObj->color, thisObj->thickness);
 			else
-				cv::drawMarker(thisObj->img_canvas, point_cur, thisObj->color, thisObj->markerType,
+				cv::drawMarker(thisObj->img_canvas, cv::Point(x, y), thisObj->color, thisObj->markerType,
 					thisObj->markerSize, thisObj->thickness, thisObj->lineType);
-			cv::imshow(thisObj->name_win, thisObj->img_canvas);
+			thisObj->show(thisObj->name_win, thisObj->img_canvas);
 			thisObj->points_marked.push_back(point_cur);
 			thisObj->dr.push_back(rect_cur);
 		}
@@ -423,12 +955,36 @@ public:
 		rectSize = rectSize_;
 		thickness = thickness_rect_;
 		color = color_rect_;
-		scale_img = scale_img_;
+		set_display_scale(scale_img_);
+		draw_cross_mode = false;
+		max_fps = 30;
+		os_debug = nullptr;
+		min_spacing = 0;
+		max_iou = 1;
+	}
+
+	// A drag produces a mouse move event for nearly every pixel, far more
+	// than can be displayed. Every event is still recorded, but the window
+	// is redrawn at most max_fps_ times per second; the last frame held back
+	// is shown as soon as the mouse stops. Use 0 to redraw on every event.
+	void set_max_fps(double max_fps_) { max_fps = max_fps_; }
 
-		rectSize.width = std::round(rectSize.width * scale_img);
-		rectSize.height = std::round(rectSize.height * scale_img);
+	// A single drag can produce hundreds of almost identical rectangles.
+	// With this capture policy a point is only recorded if it is at least
+	// min_spacing_ pixels (in original image coordinates) from the last
+	// recorded point of the stroke, and if its rectangle has an IoU of at
+	// most max_iou_ with every rectangle recorded so far for the image.
+	// The defaults (0 and 1) record every point.
+	void set_capture_policy(double min_spacing_, double max_iou_ = 1)
+	{
+		min_spacing = min_spacing_;
+		max_iou = max_iou_;
 	}
 
+	// send per-point debug messages to os_debug_ (e.g. &std::cout); nullptr
+	// (the default) disables them. Messages are buffered and written in blocks.
+	void set_debug_log(std::ostream *os_debug_) { os_debug = os_debug_; }
+
 	void set_draw_cross_mode(int size_marker_ = 20, int thickness_marker_ = 2, int lineType_marker_ = 8, 
 		cv::Scalar color_marker_ = cv::Scalar(255, 0, 0, 0), int type_marker_ = cv::MARKER_CROSS)
 	{
@@ -442,20 +998,36 @@ public:
 
 	std::vector<cv::Rect> get_dr(const cv::Mat &img)  override
 	{
-		being_dragged = false;
-		img_canvas = img.clone();
-
-		cv::resize(img_canvas, img_canvas, cv::Size(), scale_img, scale_img);
-
-		dr.clear(); dr.reserve(1000);
-
+		reset(img);
 		cv::namedWindow(name_win);
 		cv::imshow(name_win, img_canvas);
 		cv::setMouseCallback(name_win, CallBackFunc, this);
-		cv::waitKey(0);
+		// poll rather than block so that a frame held back by max_fps gets shown
+		int delay = max_fps > 0 ? std::max(1, static_cast<int>(1000.0 / max_fps)) : 0;
+		while (cv::waitKey(delay) < 0)
+			if (render_pending) render();
+		flush_debug_log();
 		return dr;
 	}
 
+	void reset(const cv::Mat &img) override
+	{
+		being_dragged = false;
+		stroke_started = false;
+		render_pending = false;
+		t_last_render = std::chrono::steady_clock::time_point();
+		size_img = img.size();
+		view.set_image(img);
+		view.get_img_disp().copyTo(img_canvas);
+
+		dr.clear(); dr.reserve(1000);
+		hash_cells.clear();
+		events_recorded.clear();
+	}
+
+	void feed_event(int event, int x, int y, int flags) override { CallBackFunc(event, x, y, flags, this); }
+	std::vector<cv::Rect> get_dr_current() override { return dr; }
+
 	cv::Mat get_img_drawn() { return img_canvas; }
 
 	//==========================================//
@@ -469,7 +1041,7 @@ public:
 	cv::Scalar color;
 	
 	std::vector<cv::Rect> dr; // recorded rectangles
-	double scale_img;
+	cv::Size size_img;
 
 	bool draw_cross_mode;
 	cv::Scalar color_marker;
@@ -478,34 +1050,136 @@ public:
 	int thickness_marker;
 	int lineType_marker;
 
-	// for drawing fixed size rectangle with the point
+	// for drawing fixed size rectangle with the point (image coordinates)
 	cv::Size rectSize;
 
+	// for capping the redraw rate
+	double max_fps;
+	bool render_pending; // canvas changed since it was last shown
+	std::chrono::steady_clock::time_point t_last_render;
+
+	// capture policy
+	double min_spacing;
+	double max_iou;
+	bool stroke_started; // a point has been recorded in the current stroke
+	cv::Point point_last; // centre of the last recorded point, original image coordinates
+	// spatial hash of dr with cells the size of the rectangles, so that
+	// only the 3x3 neighbouring cells can hold overlapping rectangles
+	std::unordered_map<long long, std::vector<int>> hash_cells;
+
+	// optional debug output
+	std::ostream *os_debug;
+	std::ostringstream log_buf;
+
+	// record the rectangle at point_cur (display coordinates) and draw it on
+	// the canvas; the canvas is shown by render() (directly or through the cap)
 	void process_point(const cv::Point &point_cur)
 	{
-		cv::Rect rect_cur = cv::Rect(point_cur, rectSize);
-		cout << "point_cur: " << point_cur << endl;
-		cout << "rectSize: " << rectSize << endl;
+		cv::Rect rect_cur = cv::Rect(view.to_img(point_cur), rectSize);
+		if (os_debug) log_buf << "point_cur: " << point_cur << "\nrectSize: " << rectSize << "\n";
 		rect_cur -= cv::Point(rectSize / 2);
-		if (rect_cur.x + rect_cur.width >= img_canvas.cols || 
-			rect_cur.y + rect_cur.height >= img_canvas.rows ||
+		if (rect_cur.x + rect_cur.width >= size_img.width || 
+			rect_cur.y + rect_cur.height >= size_img.height ||
 			rect_cur.x < 0 || rect_cur.y < 0)
 		{
-			cout << "The resulting rectangle is out of image boundary. Ignoring..." << endl;
+			if (os_debug) log_buf << "The resulting rectangle is out of image boundary. Ignoring...\n";
+			return;
+		}
+		cv::Rect rect_disp = view.to_disp(rect_cur);
+		if (!accept_rect(rect_cur))
+		{
+			if (os_debug) log_buf << "Too close to a recorded rectangle. Ignoring...\n";
 			return;
 		}
 		if(draw_cross_mode)
 			cv::drawMarker(img_canvas, point_cur, color_marker, type_marker,
 				size_marker, thickness_marker, lineType_marker);
 		else
-			cv::rectangle(img_canvas, rect_cur, color, thickness);
-		cv::imshow(name_win, img_canvas);
-		rect_cur = cv::Rect(std::round(static_cast<double>(rect_cur.x) / scale_img),
-			std::round(static_cast<double>(rect_cur.y) / scale_img),
-			std::round(static_cast<double>(rect_cur.width) / scale_img),
-			std::round(static_cast<double>(rect_cur.height) / scale_img));	
-		cout << "Recording rectangle: " << rect_cur << endl;
+			cv::rectangle(img_canvas, rect_disp, color, thickness);
+		render_pending = true;
+		if (os_debug)
+		{
+			log_buf << "Recording rectangle: " << rect_cur << "\n";
+			if (log_buf.tellp() > (1 << 16)) flush_debug_log();
+		}
 		dr.push_back(rect_cur);
+		hash_cells[hash_key(rect_cur)].push_back(static_cast<int>(dr.size()) - 1);
+		point_last = rectGrid::centre(rect_cur);
+		stroke_started = true;
+	}
+
+	// whether rect_cur (original image coordinates) passes the capture policy
+	bool accept_rect(const cv::Rect &rect_cur)
+	{
+		cv::Point c = rectGrid::centre(rect_cur);
+		if (min_spacing > 0 && stroke_started)
+		{
+			double dx = c.x - point_last.x, dy = c.y - point_last.y;
+			if (dx * dx + dy * dy < min_spacing * min_spacing) return false;
+		}
+		if (max_iou < 1)
+		{
+			cv::Size cell = cell_hash();
+			int cx = floor_div(c.x, cell.width), cy = floor_div(c.y, cell.height);
+			for (int j = cy - 1; j <= cy + 1; j++)
+				for (int i = cx - 1; i <= cx + 1; i++)
+				{
+					std::unordered_map<long long, std::vector<int>>::const_iterator it = hash_cells.find(pack_key(i, j));
+					if (it == hash_cells.end()) continue;
+					for (size_t k = 0; k < it->second.size(); k++)
+					{
+						const cv::Rect &r = dr[it->second[k]];
+						double inter = (r & rect_cur).area();
+						double iou = inter / (r.area() + rect_cur.area() - inter);
+						if (iou > max_iou) return false;
+					}
+				}
+		}
+		return true;
+	}
+
+	// the hash cells are the size of the recorded rectangles
+	cv::Size cell_hash()
+	{
+		return cv::Size(std::max(1, rectSize.width), std::max(1, rectSize.height));
+	}
+
+	long long hash_key(const cv::Rect &r)
+	{
+		cv::Point c = rectGrid::centre(r);
+		cv::Size cell = cell_hash();
+		return pack_key(floor_div(c.x, cell.width), floor_div(c.y, cell.height));
+	}
+
+	static long long pack_key(int i, int j) { return (static_cast<long long>(j) << 32) ^ static_cast<unsigned int>(i); }
+	static int floor_div(int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); }
+
+	// show the canvas if it has changed, unless the last frame was shown
+	// less than 1/max_fps seconds ago (in which case it stays pending)
+	void render_capped()
+	{
+		if (!render_pending) return;
+		if (max_fps > 0)
+		{
+			double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_last_render).count();
+			if (dt < 1.0 / max_fps) return;
+		}
+		render();
+	}
+
+	void render()
+	{
+		show(name_win, img_canvas);
+		render_pending = false;
+		t_last_render = std::chrono::steady_clock::now();
+	}
+
+	void flush_debug_log()
+	{
+		if (os_debug == nullptr) return;
+		*os_debug << log_buf.str();
+		os_debug->flush();
+		log_buf.str("");
 	}
 
 private:
@@ -513,45 +1187,566 @@ private:
 	static void CallBackFunc(int event, int x, int y, int flags, void* userdata)
 	{
 		getRect_outLine* thisObj = static_cast<getRect_outLine*>(userdata);
+		thisObj->record_event(event, x, y, flags);
 		
 		if (event == CV_EVENT_LBUTTONDOWN && !thisObj->being_dragged)
 		{
+			thisObj->stroke_started = false;
 			thisObj->process_point(cv::Point(x, y));
 			thisObj->being_dragged = true;
+			thisObj->render();
 		}
 
+		// consecutive moves are coalesced into one redraw per frame
 		if (event == CV_EVENT_MOUSEMOVE && thisObj->being_dragged)
 		{
 			thisObj->process_point(cv::Point(x, y));
+			thisObj->render_capped();
 		}
 
 		if (event == CV_EVENT_LBUTTONUP && thisObj->being_dragged)
 		{
 			thisObj->process_point(cv::Point(x, y));
 			thisObj->being_dragged = false;
+			thisObj->render();
+			thisObj->flush_debug_log();
 		}
 
 	}
 
 
 };
- 
-class manipRect
+
+// composes frames on a thread of its own into two buffers used in turn,
+// and hands the last complete one to the UI thread, which presents it (with
+// cv::imshow, which like the mouse callbacks must stay on the UI thread).
+// The mouse callbacks then only update the annotation state and request()
+// a redraw, so however long a redraw takes, events keep being taken in.
+// Requests arriving while a frame is composed are coalesced into the next
+// one, and frames are composed at most max_fps times per second.
+// compose(frame, idx_buffer) must bring frame, the buffer idx_buffer (0 or
+// 1) as left by its previous call for that buffer, up to date.
+class canvasRenderer
 {
 public:
+	typedef std::function<void(cv::Mat &frame, int idx_buffer)> composeFunc;
 
-	enum ModeClicks
+	canvasRenderer() : running(false) {}
+	~canvasRenderer() { stop(); }
+
+	void start(composeFunc compose_, double max_fps_ = 60)
 	{
-		TL_BR, C_T, C_R, C_L, C_B, T_B, L_R
-	};
+		stop();
+		compose = compose_;
+		max_fps = max_fps_;
+		idx_back = 0;
+		idx_ready = -1;
+		new_frame = false;
+		requested = true;
+		stopping = false;
+		running = true;
+		th = std::thread(&canvasRenderer::loop, this);
+	}
 
-	manipRect()
+	void stop()
 	{
-		mode_click = ModeClicks::TL_BR;
-		aspect_ratio = 0.5; // width / height
+		if (!running) return;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		cv_request.notify_all();
+		th.join();
+		running = false;
+	}
+
+	bool is_running() const { return running; }
+
+	void request()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			requested = true;
+		}
+		cv_request.notify_all();
+	}
+
+	// on the UI thread: pass the last complete frame to show_ if it has not
+	// been passed yet. The frame is not touched by the render thread meanwhile.
+	bool present(const std::function<void(const cv::Mat &)> &show_)
+	{
+		std::lock_guard<std::mutex> lock(mtx_present);
+		if (!new_frame) return false;
+		show_(buffers[idx_ready]);
+		new_frame = false;
+		return true;
+	}
+
+private:
+	composeFunc compose;
+	double max_fps; // 0 for no cap
+	cv::Mat buffers[2];
+	int idx_back; // buffer composed next; never the one being presented
+	int idx_ready; // last complete buffer; -1 before the first
+	bool new_frame; // buffers[idx_ready] not presented yet
+	bool requested, stopping, running;
+	std::thread th;
+	std::mutex mtx; // for requested and stopping
+	std::condition_variable cv_request;
+	std::mutex mtx_present; // held while presenting and while swapping
+
+	void loop()
+	{
+		std::chrono::steady_clock::time_point t_last;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cv_request.wait(lock, [this] { return requested || stopping; });
+				if (stopping) return;
+			}
+			if (max_fps > 0)
+				std::this_thread::sleep_until(t_last + std::chrono::microseconds(static_cast<long long>(1e6 / max_fps)));
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				requested = false; // what was requested until now goes into this frame
+			}
+			t_last = std::chrono::steady_clock::now();
+			compose(buffers[idx_back], idx_back);
+			std::lock_guard<std::mutex> lock(mtx_present);
+			idx_ready = idx_back;
+			new_frame = true;
+			idx_back = 1 - idx_back;
+		}
+	}
+};
+
+// a single change to a list of rectangles as manipRect makes them: ADD
+// appends r, which lands at index idx; REMOVE takes r out of index idx and
+// puts the last rectangle in its place. group_end marks the last edit of a
+// user action (a move is a REMOVE then an ADD; a box delete is several
+// REMOVEs), which is the step of undo and redo.
+struct rectEdit
+{
+	enum { ADD = 1, REMOVE = 2 };
+	int kind;
+	int idx;
+	cv::Rect r;
+	bool group_end;
+};
+
+// the edits made to the rectangles of an image, for undo and redo. Each
+// edit is undone by applying its inverse, so a step costs as many
+// operations as the action had edits, whatever the number of rectangles.
+// Applying goes through a target with add_rect(r), remove_rect(idx) and
+// insert_rect_at(idx, r) (see manipRect and rectList).
+class editHistory
+{
+public:
+	editHistory() : n_applied(0) {}
+
+	void clear() { edits.clear(); n_applied = 0; }
+
+	// a new edit (already applied) drops whatever could be redone
+	void push(const rectEdit &e)
+	{
+		edits.resize(n_applied);
+		edits.push_back(e);
+		n_applied++;
+	}
+
+	// undo the last action, calling on_edit with each edit inverted; false
+	// if there is nothing to undo
+	template<class T>
+	bool undo(T &target, const std::function<void(const rectEdit &)> &on_edit = nullptr)
+	{
+		if (n_applied == 0) return false;
+		do
+		{
+			const rectEdit &e = edits[--n_applied];
+			if (e.kind == rectEdit::ADD) target.remove_rect(e.idx);
+			else target.insert_rect_at(e.idx, e.r);
+			if (on_edit) on_edit(e);
+		} while (n_applied > 0 && !edits[n_applied - 1].group_end);
+		return true;
+	}
+
+	template<class T>
+	bool redo(T &target, const std::function<void(const rectEdit &)> &on_edit = nullptr)
+	{
+		if (n_applied == edits.size()) return false;
+		do
+		{
+			const rectEdit &e = edits[n_applied++];
+			if (e.kind == rectEdit::ADD) target.add_rect(e.r);
+			else target.remove_rect(e.idx);
+			if (on_edit) on_edit(e);
+		} while (n_applied < edits.size() && !edits[n_applied - 1].group_end);
+		return true;
+	}
+
+	template<class T>
+	static void apply(T &target, const rectEdit &e)
+	{
+		if (e.kind == rectEdit::ADD) target.add_rect(e.r);
+		else target.remove_rect(e.idx);
+	}
+
+private:
+	std::vector<rectEdit> edits;
+	size_t n_applied; // edits[n_applied..] can be redone
+};
+
+// a plain vector of rectangles edited the way manipRect edits its own
+struct rectList
+{
+	std::vector<cv::Rect> dr;
+
+	void add_rect(const cv::Rect &r) { dr.push_back(r); }
+	void remove_rect(int idx)
+	{
+		dr[idx] = dr.back();
+		dr.pop_back();
+	}
+	// the inverse of remove_rect(idx) having removed r
+	void insert_rect_at(int idx, const cv::Rect &r)
+	{
+		if (idx == static_cast<int>(dr.size()))
+		{
+			dr.push_back(r);
+			return;
+		}
+		cv::Rect moved = dr[idx];
+		dr.push_back(moved);
+		dr[idx] = r;
+	}
+};
+
+// append-only journal of an annotation session, so that a crash loses at
+// most the last fraction of a second of work. It holds, in order: the start
+// of each image with the rectangles it started from, every edit of those
+// rectangles (with manipRect; see rectEdit), undos and redos, the end of
+// each image with its final rectangles and the size of the image it was
+// annotated on, and, once its patches have all been written (which happens
+// later, in the background), its full resolution size. Opening an existing
+// journal replays it: finished images are known with their rectangles, and
+// an image left unfinished comes back with its rectangles and its undo
+// history as they were. Records are
+//   u16 magic 0x4A41 ("AJ"), u8 kind, u8 flags (1: group_end), i32 idx,
+//   i32 x, y, width, height, u32 n_payload, u32 check, then n_payload bytes
+// with check the FNV-1a hash of the record (check set to 0) and payload.
+// A torn record at the end (the process died while writing it) is cut off.
+// Recording a record only appends it to a buffer in memory; a thread of the
+// journal writes the buffer and syncs it to the disk (fsync) in batches:
+// every batch_ops_ records, every batch_ms_ milliseconds, and at the end of
+// each image. So the UI thread never waits for the disk. All methods may
+// be called from several threads.
+class annotationJournal
+{
+public:
+
+	annotationJournal(const std::string &fpath_, int batch_ops_ = 64, int batch_ms_ = 200)
+	{
+		fpath = fpath_;
+		batch_ops = batch_ops_;
+		batch_ms = batch_ms_;
+		n_pending = 0;
+		resuming = false;
+		flush_requested = false;
+		stopping = false;
+		replay();
+		f = std::fopen(fpath.c_str(), "ab");
+		if (f == nullptr)
+		{
+			printf("ERROR: could not open the journal %s\n", fpath.c_str());
+			throw std::runtime_error("");
+		}
+		flusher = std::thread(&annotationJournal::run_flusher, this);
+	}
+
+	// writes whatever is left
+	~annotationJournal()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		cv_flush.notify_all();
+		flusher.join();
+		sync();
+		std::fclose(f);
+	}
+
+	size_t n_finished() const { std::lock_guard<std::mutex> lock(mtx); return dr_finished.size(); }
+	bool is_finished(const std::string &fpath_img) const { std::lock_guard<std::mutex> lock(mtx); return dr_finished.count(fpath_img) > 0; }
+	std::vector<cv::Rect> get_dr_finished(const std::string &fpath_img) const { std::lock_guard<std::mutex> lock(mtx); return dr_finished.at(fpath_img).dr; }
+	cv::Size get_size_finished(const std::string &fpath_img) const { std::lock_guard<std::mutex> lock(mtx); return dr_finished.at(fpath_img).size_img; }
+
+	// the full resolution size of fpath_img; (0, 0) if it was not recorded
+	cv::Size get_size_full(const std::string &fpath_img) const
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		std::unordered_map<std::string, cv::Size>::const_iterator it = sizes_full.find(fpath_img);
+		return it == sizes_full.end() ? cv::Size() : it->second;
+	}
+
+	// start annotating fpath_img from dr_init. If fpath_img was being
+	// annotated when the journal was last written, its rectangles then are
+	// returned instead (and its history is kept); otherwise dr_init.
+	std::vector<cv::Rect> begin_image(const std::string &fpath_img, const std::vector<cv::Rect> &dr_init)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (resuming && fpath_img == fpath_current)
+		{
+			resuming = false;
+			return list_current.dr;
+		}
+		resuming = false;
+		fpath_current = fpath_img;
+		list_current.dr = dr_init;
+		history_current.clear();
+		append(BEGIN_IMAGE, 0, cv::Rect(), false, &fpath_img, &dr_init);
+		return dr_init;
+	}
+
+	// the undo history of the image started by the last begin_image()
+	const editHistory& get_history() const { return history_current; }
+
+	void append_edit(const rectEdit &e)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		append(e.kind == rectEdit::ADD ? ADD : REMOVE, e.idx, e.r, e.group_end);
+	}
+	void append_undo() { std::lock_guard<std::mutex> lock(mtx); append(UNDO, 0, cv::Rect(), false); }
+	void append_redo() { std::lock_guard<std::mutex> lock(mtx); append(REDO, 0, cv::Rect(), false); }
+
+	// fpath_img is done, with the rectangles dr on an image of size_img
+	void finish_image(const std::string &fpath_img, const cv::Size &size_img, const std::vector<cv::Rect> &dr)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		append(FINISH_IMAGE, 0, cv::Rect(0, 0, size_img.width, size_img.height), false, &fpath_img, &dr);
+		dr_finished[fpath_img] = finishedImage{ size_img, dr };
+		request_flush();
+	}
+
+	// the patches of fpath_img have all been written; its full resolution
+	// size is size_full
+	void set_size_full(const std::string &fpath_img, const cv::Size &size_full)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		append(SIZE_FULL, 0, cv::Rect(0, 0, size_full.width, size_full.height), false, &fpath_img);
+		sizes_full[fpath_img] = size_full;
+	}
+
+	// write and sync every record recorded so far; blocks until done
+	void sync()
+	{
+		// the file lock is held from taking the buffer to writing it, so
+		// that buffers are written in the order they were taken
+		std::lock_guard<std::mutex> lock_file(mtx_file);
+		std::vector<char> buf_out;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			buf_out.swap(buf);
+			n_pending = 0;
+			flush_requested = false;
+		}
+		if (buf_out.empty()) return;
+		bool ok = std::fwrite(&buf_out[0], 1, buf_out.size(), f) == buf_out.size() && std::fflush(f) == 0;
+#ifdef _WIN32
+		ok = ok && _commit(_fileno(f)) == 0;
+#else
+		ok = ok && fsync(fileno(f)) == 0;
+#endif
+		if (!ok) cout << "Failed to write the journal " << fpath << endl;
+	}
+
+private:
+	enum Kind { BEGIN_IMAGE = 1, ADD = 2, REMOVE = 3, UNDO = 4, REDO = 5, FINISH_IMAGE = 6, SIZE_FULL = 7 };
+	static const uint16_t magic = 0x4A41;
+
+	// with the state locked
+	void request_flush()
+	{
+		flush_requested = true;
+		cv_flush.notify_one();
+	}
+
+	// writes the buffer when asked to, or batch_ms after the last write
+	void run_flusher()
+	{
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cv_flush.wait_for(lock, std::chrono::milliseconds(batch_ms), [this] { return stopping || flush_requested; });
+				if (stopping) return; // the destructor writes the rest
+			}
+			sync();
+		}
+	}
+
+	struct record
+	{
+		uint16_t magic;
+		uint8_t kind;
+		uint8_t flags;
+		int32_t idx;
+		int32_t x, y, width, height;
+		uint32_t n_payload;
+		uint32_t check;
+	};
+
+	struct finishedImage
+	{
+		cv::Size size_img;
+		std::vector<cv::Rect> dr;
+	};
+
+	std::string fpath;
+	FILE *f;
+	int batch_ops, batch_ms;
+	std::vector<char> buf; // records not written yet
+	int n_pending;
+	bool flush_requested, stopping;
+	std::condition_variable cv_flush;
+	std::thread flusher;
+	std::mutex mtx_file; // held while a buffer is being written
+
+	mutable std::mutex mtx;
+	std::unordered_map<std::string, finishedImage> dr_finished;
+	std::unordered_map<std::string, cv::Size> sizes_full;
+	std::string fpath_current; // image begun last
+	rectList list_current; // its rectangles, while replaying
+	editHistory history_current;
+	bool resuming; // fpath_current was left unfinished by a previous session
+
+	// with a BEGIN_IMAGE, FINISH_IMAGE or SIZE_FULL, the payload is the path
+	// of the image (idx is its length) followed by the rectangles as 4 x i32.
+	// With the state locked.
+	void append(Kind kind, int idx, const cv::Rect &r, bool group_end,
+		const std::string *fpath_img = nullptr, const std::vector<cv::Rect> *dr = nullptr)
+	{
+		std::vector<char> payload;
+		if (fpath_img)
+		{
+			idx = static_cast<int>(fpath_img->size());
+			payload.assign(fpath_img->begin(), fpath_img->end());
+			for (size_t i = 0; dr && i < dr->size(); i++)
+			{
+				int32_t v[4] = { (*dr)[i].x, (*dr)[i].y, (*dr)[i].width, (*dr)[i].height };
+				payload.insert(payload.end(), reinterpret_cast<const char*>(v), reinterpret_cast<const char*>(v) + sizeof(v));
+			}
+		}
+		record h{ magic, static_cast<uint8_t>(kind), static_cast<uint8_t>(group_end ? 1 : 0), idx,
+			r.x, r.y, r.width, r.height, static_cast<uint32_t>(payload.size()), 0 };
+		h.check = checksum(h, payload);
+		buf.insert(buf.end(), reinterpret_cast<const char*>(&h), reinterpret_cast<const char*>(&h) + sizeof(h));
+		buf.insert(buf.end(), payload.begin(), payload.end());
+		if (++n_pending >= batch_ops) request_flush();
+	}
+
+	static uint32_t checksum(const record &h, const std::vector<char> &payload)
+	{
+		uint32_t c = 2166136261u;
+		record h0 = h;
+		h0.check = 0;
+		const unsigned char *p = reinterpret_cast<const unsigned char*>(&h0);
+		for (size_t i = 0; i < sizeof(h0); i++) c = (c ^ p[i]) * 16777619u;
+		for (size_t i = 0; i < payload.size(); i++) c = (c ^ static_cast<unsigned char>(payload[i])) * 16777619u;
+		return c;
+	}
+
+	// rebuild the state from the journal and cut off a torn tail
+	void replay()
+	{
+		FILE *fi = std::fopen(fpath.c_str(), "rb");
+		if (fi == nullptr) return; // a new journal
+		long long end_valid = 0;
+		record h;
+		std::vector<char> payload;
+		while (std::fread(&h, sizeof(h), 1, fi) == 1 && h.magic == magic && h.n_payload < (1u << 30))
+		{
+			payload.resize(h.n_payload);
+			if (!payload.empty() && std::fread(&payload[0], 1, payload.size(), fi) != payload.size()) break;
+			if (checksum(h, payload) != h.check) break;
+			apply(h, payload);
+			end_valid += sizeof(h) + h.n_payload;
+		}
+		std::fclose(fi);
+		if (static_cast<long long>(std::filesystem::file_size(fpath)) > end_valid)
+		{
+			cout << "Journal " << fpath << ": cutting off a torn record at byte " << end_valid << endl;
+			std::filesystem::resize_file(fpath, end_valid);
+		}
+	}
+
+	void apply(const record &h, const std::vector<char> &payload)
+	{
+		switch (h.kind)
+		{
+		case BEGIN_IMAGE:
+		case FINISH_IMAGE:
+		case SIZE_FULL:
+		{
+			std::string fpath_img(payload.begin(), payload.begin() + std::min<size_t>(h.idx, payload.size()));
+			std::vector<cv::Rect> dr((payload.size() - fpath_img.size()) / (4 * sizeof(int32_t)));
+			for (size_t i = 0; i < dr.size(); i++)
+			{
+				int32_t v[4];
+				std::memcpy(v, &payload[fpath_img.size() + i * sizeof(v)], sizeof(v));
+				dr[i] = cv::Rect(v[0], v[1], v[2], v[3]);
+			}
+			if (h.kind == SIZE_FULL)
+				sizes_full[fpath_img] = cv::Size(h.width, h.height);
+			else if (h.kind == BEGIN_IMAGE)
+			{
+				fpath_current = fpath_img;
+				list_current.dr = dr;
+				history_current.clear();
+				resuming = true;
+			}
+			else
+			{
+				dr_finished[fpath_img] = finishedImage{ cv::Size(h.width, h.height), dr };
+				resuming = false;
+			}
+			break;
+		}
+		case ADD:
+		case REMOVE:
+		{
+			rectEdit e{ h.kind == ADD ? rectEdit::ADD : rectEdit::REMOVE, h.idx, cv::Rect(h.x, h.y, h.width, h.height), (h.flags & 1) != 0 };
+			editHistory::apply(list_current, e);
+			history_current.push(e);
+			break;
+		}
+		case UNDO: history_current.undo(list_current); break;
+		case REDO: history_current.redo(list_current); break;
+		}
+	}
+};
+
+// a comprehensive class for manipulating rectangles by the user: adding new
+// ones (in any of the getRect_2clicks modes), moving and deleting existing ones
+class manipRect : public getRect_user
+{
+public:
+
+	enum ModeClicks
+	{
+		TL_BR, C_T, C_R, C_L, C_B, T_B, L_R
+	};
+
+	manipRect()
+	{
+		mode_click = ModeClicks::TL_BR;
+		aspect_ratio = 0.5; // width / height
 		name_win = "Get rectangles from user";
 		thickness_rect = 2;
 		color_rect = cv::Scalar(255, 0, 0, 0);
+		max_fps = 60;
+		journal = nullptr;
 	}
 
 	// for ModeClicks::TL_BR, aspect_ratio_ is being 0 has a special meaning that
@@ -570,82 +1765,366 @@ public:
 		name_win = name_win_;
 		thickness_rect = thickness_rect_;
 		color_rect = color_rect_;
+		max_fps = 60;
+		journal = nullptr;
 	}
+
+	// The window is redrawn by a render thread (see canvasRenderer) at most
+	// max_fps_ times per second, however fast the events come. 0 for no cap.
+	void set_max_fps(double max_fps_) { max_fps = max_fps_; }
+
+	// every add, move and delete is recorded into journal_ as it is made
+	// (see annotationJournal); the journal should be used through
+	// annotate_obj_det_dataset::set_journal, which starts and ends the images
+	void set_journal(annotationJournal *journal_) override { journal = journal_; }
 	
-	std::vector<cv::Rect> get_dr(const cv::Mat &img, const std::vector<cv::Rect> dr_)
+	std::vector<cv::Rect> get_dr(const cv::Mat &img, const std::vector<cv::Rect> &dr_) override
+	{
+		reset(img, dr_);
+		cv::namedWindow(name_win);
+		cv::imshow(name_win, img_canvas_orig);
+		cv::createTrackbar("Delete mode", name_win, &val_trackbar, 1, CallBackFunc_trackbar, this);
+		cv::setMouseCallback(name_win, CallBackFunc_mouse, this);
+		renderer.start([this](cv::Mat &frame, int idx_buffer) { compose(frame, idx_buffer); }, max_fps);
+		// events are taken in by waitKey; frames are shown as they are ready.
+		// z (or Ctrl+Z) undoes the last action, y (or Ctrl+Y) redoes it, and
+		// any other key ends the image.
+		int delay = max_fps > 0 ? std::max(1, static_cast<int>(1000.0 / max_fps)) : 1;
+		while (true)
+		{
+			int key = cv::waitKey(delay);
+			if (key == 'z' || key == 26 || key == 'y' || key == 25) CallBackFunc_key(key, this);
+			else if (key >= 0) break;
+			renderer.present([this](const cv::Mat &frame) { show(name_win, frame); });
+		}
+		renderer.stop();
+		return dr;
+	}
+
+	// start with no rectangles
+	std::vector<cv::Rect> get_dr(const cv::Mat &img) override
+	{
+		return get_dr(img, std::vector<cv::Rect>());
+	}
+
+	void reset(const cv::Mat &img, const std::vector<cv::Rect> &dr_) override
 	{
+		renderer.stop();
 		firstClickDone = false;
-		img_canvas_orig = img.clone();
-		img_canvas = img.clone();
+		view.set_image(img);
+		view.get_img_disp().copyTo(img_canvas_orig);
 		dr = dr_;
-		update_canvas();
 		dr.reserve(30);
-		cv::namedWindow(name_win);
-		cv::imshow(name_win, img_canvas);
+		history = journal ? journal->get_history() : editHistory();
+		shape_overlay = overlayShape();
+		for (int b = 0; b < 2; b++)
+		{
+			damage[b].clear();
+			redraw_full[b] = true;
+			footprint_overlay[b] = cv::Rect();
+		}
+		grid.reset(img.size());
+		for (size_t i = 0; i < dr.size(); i++)
+			grid.insert(static_cast<int>(i), dr[i]);
 		val_trackbar = 0;
 		being_dragged = false;
-		cv::createTrackbar("Delete mode", name_win, &val_trackbar, 1, CallBackFunc_trackbar, this);
-		cv::setMouseCallback(name_win, CallBackFunc_mouse, this);
-		cv::waitKey(0);
-		return dr;
+		events_recorded.clear();
+		if (headless) compose(frame_headless, 0); // the first frame, as get_dr() shows it
+	}
+
+	void reset(const cv::Mat &img) override { reset(img, std::vector<cv::Rect>()); }
+	std::vector<cv::Rect> get_dr_current() override { return dr; }
+
+	void feed_event(int event, int x, int y, int flags) override
+	{
+		if (event == mouseEvent::EVENT_TRACKBAR)
+			CallBackFunc_trackbar(x, this);
+		else if (event == mouseEvent::EVENT_KEY)
+			CallBackFunc_key(x, this);
+		else
+			CallBackFunc_mouse(event, x, y, flags, this);
+		// headless, there is no render thread: compose here, so that a
+		// replay or a benchmark does the same drawing as a session
+		if (headless && !renderer.is_running())
+			compose(frame_headless, 0);
 	}
 
 	// update the image canvas with current latest vector of rectangles
-	// this can 
 	void update_canvas()
 	{
-		img_canvas = img_canvas_orig.clone();
+		img_canvas_orig.copyTo(img_canvas);
 		for (size_t i = 0; i < dr.size(); i++)
-			cv::rectangle(img_canvas, dr[i], color_rect, thickness_rect);		
+			cv::rectangle(img_canvas, view.to_disp(dr[i]), color_rect, thickness_rect);		
 	}
 
-	// find the index of the nearest rectangles among the 
-	// vector of rectangles (in the data member dr) from the given point p
-	int find_nearest_rect(const cv::Point &p)
+	// bring frame, buffer idx_buffer of the renderer, up to date (runs on
+	// the render thread). Only the regions damaged since the buffer was last
+	// composed are redrawn: their pixels are restored from the original
+	// image and just the rectangles that overlap them are drawn again, so
+	// the cost scales with the edits rather than with the image size times
+	// the number of rectangles. The state is only locked while the
+	// rectangles to draw are looked up.
+	void compose(cv::Mat &frame, int idx_buffer)
 	{
-		std::vector<cv::Rect> dr_temp = dr;
-		auto center_rect = [](cv::Rect rr) { return cv::Point(rr.x + rr.width / 2, rr.y + rr.height / 2); };
-		auto dist = [&center_rect](cv::Rect rr, cv::Point pp) { return std::sqrt(std::pow(center_rect(rr).x - pp.x, 2) + std::pow(center_rect(rr).y - pp.y, 2)); };
-		auto compare = [&p, &dr_temp, &dist](int i, int j) { return dist(dr_temp[i], p) < dist(dr_temp[j], p); };
+		bool full;
+		overlayShape shape;
+		std::vector<cv::Rect> &regions = regions_compose, &rects = rects_compose;
+		std::vector<size_t> &ends = ends_compose; // rects of regions[i] end at ends[i]
+		regions.clear(); rects.clear(); ends.clear();
+		{
+			std::lock_guard<std::mutex> lock(mtx_state);
+			full = redraw_full[idx_buffer] || frame.size() != img_canvas_orig.size();
+			shape = shape_overlay;
+			if (full)
+			{
+				for (size_t i = 0; i < dr.size(); i++)
+					rects.push_back(view.to_disp(dr[i]));
+			}
+			else
+			{
+				regions.swap(damage[idx_buffer]);
+				if (footprint_overlay[idx_buffer].area() > 0) regions.push_back(footprint_overlay[idx_buffer]);
+				for (size_t j = 0; j < regions.size(); j++)
+				{
+					regions[j] &= cv::Rect(0, 0, img_canvas_orig.cols, img_canvas_orig.rows);
+					// being axis aligned, rectangles drawn clipped to a region land
+					// on exactly the same pixels as on the full canvas
+					int margin = static_cast<int>(std::ceil((thickness_rect / 2 + 3) / view.get_scale()));
+					cv::Rect roi_img = view.to_img(regions[j]);
+					if (regions[j].area() > 0)
+						grid.query_overlap(cv::Rect(roi_img.x - margin, roi_img.y - margin,
+							roi_img.width + 2 * margin, roi_img.height + 2 * margin), ids_compose);
+					for (size_t k = 0; regions[j].area() > 0 && k < ids_compose.size(); k++)
+					{
+						cv::Rect r = view.to_disp(dr[ids_compose[k]]);
+						if ((footprint_disp(r) & regions[j]).area() > 0) rects.push_back(r);
+					}
+					ends.push_back(rects.size());
+				}
+			}
+			damage[idx_buffer].clear();
+			redraw_full[idx_buffer] = false;
+		}
 
-		std::vector<int> indices(dr.size());
-		std::iota(indices.begin(), indices.end(), 0);
+		if (full)
+		{
+			img_canvas_orig.copyTo(frame);
+			for (size_t i = 0; i < rects.size(); i++)
+				cv::rectangle(frame, rects[i], color_rect, thickness_rect);
+		}
+		else
+		{
+			for (size_t j = 0; j < regions.size(); j++)
+			{
+				if (regions[j].area() <= 0) continue;
+				cv::Mat frame_roi = frame(regions[j]);
+				img_canvas_orig(regions[j]).copyTo(frame_roi);
+				for (size_t k = j == 0 ? 0 : ends[j - 1]; k < ends[j]; k++)
+					cv::rectangle(frame_roi, rects[k] - regions[j].tl(), color_rect, thickness_rect);
+			}
+		}
 
-		std::nth_element(indices.begin(), indices.begin() + 1, indices.end(), compare);
+		// the overlay is drawn last and erased on the next compose of this buffer
+		footprint_overlay[idx_buffer] = cv::Rect();
+		if (shape.kind == overlayShape::RECT)
+		{
+			cv::rectangle(frame, shape.p1, shape.p2, color_rect, thickness_rect);
+			footprint_overlay[idx_buffer] = footprint_disp(cv::Rect(shape.p1, shape.p2));
+		}
+		else if (shape.kind == overlayShape::MARKER)
+		{
+			cv::drawMarker(frame, shape.p1, color_rect, cv::MARKER_CROSS, size_marker, 2, 8);
+			int r = size_marker / 2 + 3;
+			footprint_overlay[idx_buffer] = cv::Rect(shape.p1.x - r, shape.p1.y - r, 2 * r + 1, 2 * r + 1);
+		}
+	}
 
-		return indices[0];
+	// region (display coordinates) has changed; with the state locked.
+	// Past a few hundred regions a buffer is simply redrawn in full; so it
+	// is when there is no render thread, until get_img_drawn() is called,
+	// except for buffer 0 when headless, which feed_event() composes.
+	void add_damage(const cv::Rect &region)
+	{
+		for (int b = 0; b < 2; b++)
+		{
+			if (redraw_full[b]) continue;
+			bool composed = renderer.is_running() || (headless && b == 0);
+			if (!composed || damage[b].size() >= 512)
+			{
+				redraw_full[b] = true;
+				damage[b].clear();
+			}
+			else
+				damage[b].push_back(region);
+		}
 	}
 
-	cv::Mat get_img_drawn() { return img_canvas; }
+	// with the state locked
+	void set_overlay(int kind, const cv::Point &p1 = cv::Point(), const cv::Point &p2 = cv::Point())
+	{
+		shape_overlay.kind = kind;
+		shape_overlay.p1 = p1;
+		shape_overlay.p2 = p2;
+	}
 
-	//==========================================//
-	// Public data members: not for users to call directly; for CallBackFunc static method
-	//==========================================//
-	std::string name_win;
-	int thickness_rect;
-	cv::Scalar color_rect;
-	std::vector<cv::Rect> dr;
-	cv::Mat img_canvas;
-	cv::Mat img_canvas_orig; // to save it so that I can use it in case of redraws
-	cv::Point point1, point2;
-	bool firstClickDone;
-	bool being_dragged;
-	cv::Rect rect_dragged; // for moving an existing rectangle
-	ModeClicks mode_click;
-	float aspect_ratio;
-	// if 0, then new rectangle or move existing rectangles
-	// if 1, delete rectangle mode
-	int val_trackbar; 
+	void request_redraw() { if (renderer.is_running()) renderer.request(); }
 
-private:
+	// add a rectangle, keeping the spatial index in sync
+	void add_rect(const cv::Rect &r)
+	{
+		dr.push_back(r);
+		grid.insert(static_cast<int>(dr.size()) - 1, r);
+	}
 
-	/*
-	----------------------------
-	When val_trackbar == 0 (non-delete mode)
-	----------------------------
-	(1) two separate left button clicks (not double click): add a new rectangle
-	how the rectangle is formed depends on ModeClicks. 
-	(2) right button click and drag: move an existing nearest rectangle
+	// remove the rectangle at index idx, keeping the spatial index in sync.
+	// The last rectangle takes its place, so this is O(1) but does not keep
+	// the order of dr.
+	void remove_rect(int idx)
+	{
+		int idx_last = static_cast<int>(dr.size()) - 1;
+		grid.remove(idx, dr[idx]);
+		if (idx != idx_last)
+		{
+			grid.relabel(idx_last, idx, dr[idx_last]);
+			dr[idx] = dr[idx_last];
+		}
+		dr.pop_back();
+	}
+
+	// put r back at index idx, moving the rectangle there to the end: the
+	// inverse of remove_rect(idx) having removed r
+	void insert_rect_at(int idx, const cv::Rect &r)
+	{
+		if (idx == static_cast<int>(dr.size()))
+		{
+			add_rect(r);
+			return;
+		}
+		cv::Rect moved = dr[idx];
+		grid.relabel(idx, static_cast<int>(dr.size()), moved);
+		dr.push_back(moved);
+		dr[idx] = r;
+		grid.insert(idx, r);
+	}
+
+	// an edit just made; with the state locked
+	void record_edit(int kind, int idx, const cv::Rect &r, bool group_end)
+	{
+		rectEdit e{ kind, idx, r, group_end };
+		history.push(e);
+		if (journal) journal->append_edit(e);
+	}
+
+	// undo or redo the last action (an add, a move or a delete, which may
+	// be of many rectangles); false if there is none
+	bool undo() { return undo_redo(true); }
+	bool redo() { return undo_redo(false); }
+
+	bool undo_redo(bool undo_)
+	{
+		std::lock_guard<std::mutex> lock(mtx_state);
+		if (being_dragged) return false; // in the middle of an action
+		std::function<void(const rectEdit &)> on_edit = [this](const rectEdit &e) { add_damage(footprint_rect(e.r)); };
+		bool done = undo_ ? history.undo(*this, on_edit) : history.redo(*this, on_edit);
+		if (!done) return false;
+		if (journal)
+		{
+			if (undo_) journal->append_undo(); else journal->append_redo();
+		}
+		firstClickDone = false;
+		set_overlay(overlayShape::NONE);
+		request_redraw();
+		return true;
+	}
+
+	// the region of the canvas covered when drawing rectangle r (image coordinates)
+	cv::Rect footprint_rect(const cv::Rect &r)
+	{
+		return footprint_disp(view.to_disp(r));
+	}
+
+	// the region of the canvas covered when drawing rectangle r_disp (display coordinates)
+	cv::Rect footprint_disp(const cv::Rect &r_disp)
+	{
+		int pad = thickness_rect / 2 + 2;
+		return cv::Rect(r_disp.x - pad, r_disp.y - pad, r_disp.width + 2 * pad + 1, r_disp.height + 2 * pad + 1);
+	}
+
+	// find the index of the nearest rectangles among the 
+	// vector of rectangles (in the data member dr) from the given point p.
+	// Returns -1 if there are no rectangles.
+	int find_nearest_rect(const cv::Point &p)
+	{
+		return grid.nearest(p, dr);
+	}
+
+	// the image with the rectangles, drawn on request
+	cv::Mat get_img_drawn()
+	{
+		std::lock_guard<std::mutex> lock(mtx_state);
+		update_canvas();
+		return img_canvas;
+	}
+
+	// a shape drawn over the rectangles (display coordinates): the rectangle
+	// being selected or moved, or the marker of a first click
+	struct overlayShape
+	{
+		enum { NONE, RECT, MARKER };
+		int kind = NONE;
+		cv::Point p1, p2; // corners of RECT; position of MARKER
+	};
+
+	//==========================================//
+	// Public data members: not for users to call directly; for CallBackFunc static method
+	//==========================================//
+	std::string name_win;
+	int thickness_rect;
+	cv::Scalar color_rect;
+	std::vector<cv::Rect> dr;
+	cv::Mat img_canvas; // for get_img_drawn
+	cv::Mat img_canvas_orig; // to save it so that I can use it in case of redraws
+	rectGrid grid; // spatial index over dr
+	std::vector<int> ids_temp, ids_del_temp; // reused for grid queries
+
+	// state shared with the render thread: the callbacks change it and
+	// compose() reads it, each with mtx_state locked
+	std::mutex mtx_state;
+	overlayShape shape_overlay;
+	std::vector<cv::Rect> damage[2]; // regions changed since each buffer was composed
+	bool redraw_full[2]; // each buffer to be redrawn in full
+	static const int size_marker = 20;
+
+	// used by compose() only
+	cv::Rect footprint_overlay[2]; // where the overlay was drawn on each buffer
+	std::vector<cv::Rect> regions_compose, rects_compose;
+	std::vector<size_t> ends_compose;
+	std::vector<int> ids_compose;
+	cv::Mat frame_headless; // composed by feed_event() when headless
+
+	editHistory history; // of the edits to dr, for undo
+	annotationJournal *journal; // not owned; nullptr for none
+	double max_fps;
+	canvasRenderer renderer; // last, so that it stops before the rest is destroyed
+	cv::Point point1, point2; // image coordinates
+	bool firstClickDone;
+	bool being_dragged;
+	cv::Rect rect_dragged; // for moving an existing rectangle (image coordinates)
+	ModeClicks mode_click;
+	float aspect_ratio;
+	// if 0, then new rectangle or move existing rectangles
+	// if 1, delete rectangle mode
+	int val_trackbar; 
+
+private:
+
+	/*
+	----------------------------
+	When val_trackbar == 0 (non-delete mode)
+	----------------------------
+	(1) two separate left button clicks (not double click): add a new rectangle
+	how the rectangle is formed depends on ModeClicks. 
+	(2) right button click and drag: move an existing nearest rectangle
 	----------------------------
 	When val_trackbar == 1 (delete mode)
 	----------------------------
@@ -657,16 +2136,24 @@ private:
 	static void CallBackFunc_mouse(int event, int x, int y, int flags, void* userdata)
 	{
 		manipRect* thisObj = static_cast<manipRect*>(userdata);
+		thisObj->record_event(event, x, y, flags);
+		std::lock_guard<std::mutex> lock(thisObj->mtx_state);
+		cv::Point p_img = thisObj->view.to_img(cv::Point(x, y));
 
 		// ======================================================= //
 		// delete mode: case 1 (deleting single rectangle by single right click)
 		// ======================================================= //
 		if (event == CV_EVENT_RBUTTONDOWN && thisObj->val_trackbar == 1)
 		{
-			cv::Point p = cv::Point(x, y);
-			thisObj->dr.erase(thisObj->dr.begin() + thisObj->find_nearest_rect(p));
-			thisObj->update_canvas();
-			cv::imshow(thisObj->name_win, thisObj->img_canvas);
+			int idx_rect_sel = thisObj->find_nearest_rect(p_img);
+			if (idx_rect_sel >= 0)
+			{
+				cv::Rect rect_del = thisObj->dr[idx_rect_sel];
+				thisObj->remove_rect(idx_rect_sel);
+				thisObj->record_edit(rectEdit::REMOVE, idx_rect_sel, rect_del, true);
+				thisObj->add_damage(thisObj->footprint_rect(rect_del));
+				thisObj->request_redraw();
+			}
 		}
 		
 		// ======================================================= //
@@ -676,36 +2163,40 @@ private:
 		if (event == CV_EVENT_LBUTTONDOWN && !thisObj->being_dragged && thisObj->val_trackbar == 1)
 		{
 			/* left button clicked. ROI selection begins */
-			thisObj->point1 = cv::Point(x, y);
+			thisObj->point1 = p_img;
 			thisObj->being_dragged = true;
 		}
 
 		if (event == CV_EVENT_MOUSEMOVE && thisObj->being_dragged && thisObj->val_trackbar == 1)
 		{
 			/* mouse dragged. ROI being selected */
-			cv::Mat img_temp = thisObj->img_canvas.clone();
-			thisObj->point2 = cv::Point(x, y);
-			cv::rectangle(img_temp, thisObj->point1, thisObj->point2, thisObj->color_rect, thisObj->thickness_rect);
-			cv::imshow(thisObj->name_win, img_temp);
+			thisObj->point2 = p_img;
+			thisObj->set_overlay(overlayShape::RECT, thisObj->view.to_disp(thisObj->point1), cv::Point(x, y));
+			thisObj->request_redraw();
 		}
 
 		if (event == CV_EVENT_LBUTTONUP && thisObj->being_dragged && thisObj->val_trackbar == 1)
 		{
-			thisObj->point2 = cv::Point(x, y);
+			thisObj->point2 = p_img;
 			thisObj->being_dragged = false;
 			// box within which to delete all the rectangles
 			cv::Rect rect_delBox(thisObj->point1, thisObj->point2);
-			std::vector<cv::Rect>::iterator iter;
-			for (iter= thisObj->dr.begin(); iter!= thisObj->dr.end();)
+			// all rectangles whose centres are inside the box; removing from the
+			// highest index down keeps the remaining indices valid
+			std::vector<int> &ids_del = thisObj->ids_del_temp;
+			thisObj->grid.query_centres(rect_delBox, thisObj->dr, ids_del);
+			std::sort(ids_del.begin(), ids_del.end(), std::greater<int>());
+			std::vector<cv::Rect> dr_del(ids_del.size());
+			for (size_t i = 0; i < ids_del.size(); i++)
 			{
-				cv::Point centre_cur_box = cv::Point(iter->x + iter->width / 2, iter->y + iter->height / 2);
-				if (rect_delBox.contains(centre_cur_box))
-					iter = thisObj->dr.erase(iter);
-				else
-					++iter;
+				dr_del[i] = thisObj->dr[ids_del[i]];
+				thisObj->remove_rect(ids_del[i]);
+				thisObj->record_edit(rectEdit::REMOVE, ids_del[i], dr_del[i], i + 1 == ids_del.size());
 			}
-			thisObj->update_canvas();
-			cv::imshow(thisObj->name_win, thisObj->img_canvas);
+			for (size_t i = 0; i < dr_del.size(); i++)
+				thisObj->add_damage(thisObj->footprint_rect(dr_del[i]));
+			thisObj->set_overlay(overlayShape::NONE);
+			thisObj->request_redraw();
 		}
 		
 		// ======================================================= //
@@ -713,255 +2204,4135 @@ private:
 		// ======================================================= //
 		if (event == CV_EVENT_LBUTTONUP && !thisObj->being_dragged && thisObj->val_trackbar == 0)
 		{
-			// process second click: got a rectangle; display & save it
-			if (thisObj->firstClickDone)
-			{
-				thisObj->point2 = cv::Point(x, y);
-				cv::Rect rect_cur;
+			// process second click: got a rectangle; display & save it
+			if (thisObj->firstClickDone)
+			{
+				thisObj->point2 = p_img;
+				cv::Rect rect_cur;
+
+				switch (thisObj->mode_click)
+				{
+				case manipRect::ModeClicks::TL_BR:
+				{
+					rect_cur = cv::Rect(thisObj->point1, thisObj->point2);
+
+					// if not the special user specified aspect ratio of 0
+					// then I will adjust the rect_cur so that it will
+					// satisfy the abs(aspect_ratio)
+					if (thisObj->aspect_ratio != 0)
+					{
+						// estimate center of rectangle
+						int cx = thisObj->point1.x + rect_cur.width / 2;
+						int cy = thisObj->point1.y + rect_cur.height / 2;
+						int w, h;
+
+						// keep height and change width
+						if (thisObj->aspect_ratio > 0)
+						{
+							h = rect_cur.height;
+							w = static_cast<float>(h) * std::abs(thisObj->aspect_ratio);
+						}
+						// keep width, change height
+						else
+						{
+							w = rect_cur.width;
+							h = static_cast<float>(w) / std::abs(thisObj->aspect_ratio);
+						}
+						rect_cur = cv::Rect(cx - w / 2, cy - h / 2, w, h);
+					}
+					break;
+				}
+
+				case manipRect::ModeClicks::C_T:
+				{
+					// find the half height first
+					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
+					int h = rect_temp.height * 2;
+					int w = std::round(thisObj->aspect_ratio * static_cast<float>(h));
+					rect_cur = cv::Rect(thisObj->point1.x - w / 2, thisObj->point1.y - h / 2, w, h);
+					break;
+				}
+
+				case manipRect::ModeClicks::C_R:
+				{
+					// find half width first
+					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
+					int w = rect_temp.width * 2;
+					int h = std::round(static_cast<float>(w) / thisObj->aspect_ratio);
+					rect_cur = cv::Rect(thisObj->point1.x - w / 2, thisObj->point1.y - h / 2, w, h);
+					break;
+				}
+
+				case manipRect::ModeClicks::C_L:
+				{
+					// find half width first
+					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
+					int w = rect_temp.width * 2;
+					int h = std::round(static_cast<float>(w) / thisObj->aspect_ratio);
+					rect_cur = cv::Rect(thisObj->point1.x - w / 2, thisObj->point1.y - h / 2, w, h);
+					break;
+				}
+
+				case manipRect::ModeClicks::C_B:
+				{
+					// find the half height first
+					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
+					int h = rect_temp.height * 2;
+					int w = std::round(thisObj->aspect_ratio * static_cast<float>(h));
+					rect_cur = cv::Rect(thisObj->point1.x - w / 2, thisObj->point1.y - h / 2, w, h);
+					break;
+				}
+
+				case manipRect::ModeClicks::T_B:
+				{
+					// find the full height first
+					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
+					int h = rect_temp.height;
+					int w = std::round(thisObj->aspect_ratio * static_cast<float>(h));
+					rect_cur = cv::Rect((rect_temp.x + rect_temp.width / 2) - w / 2,
+						(rect_temp.y + rect_temp.height / 2) - h / 2, w, h);
+					break;
+				}
+
+				case manipRect::ModeClicks::L_R:
+				{
+					// find the full width first
+					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
+					int w = rect_temp.width;
+					int h = std::round(static_cast<float>(w) / thisObj->aspect_ratio);
+					rect_cur = cv::Rect((rect_temp.x + rect_temp.width / 2) - w / 2,
+						(rect_temp.y + rect_temp.height / 2) - h / 2, w, h);
+					break;
+				}
+
+				} // end switch		
+
+				thisObj->add_rect(rect_cur);
+				thisObj->record_edit(rectEdit::ADD, static_cast<int>(thisObj->dr.size()) - 1, rect_cur, true);
+				thisObj->add_damage(thisObj->footprint_rect(rect_cur));
+				thisObj->set_overlay(overlayShape::NONE);
+				thisObj->request_redraw();
+				thisObj->firstClickDone = false;
+			}
+
+			// process first click; just display the current image + the initial point
+			// wait for the second click to form the rectangle
+			else
+			{
+				thisObj->point1 = p_img;
+				thisObj->set_overlay(overlayShape::MARKER, cv::Point(x, y));
+				thisObj->request_redraw();
+				thisObj->firstClickDone = true;
+			}
+		}
+
+		// ======================================================= //
+		// non-delete mode: case 2 (moving using right click & drag)
+		// ======================================================= //
+		if (event == CV_EVENT_RBUTTONDOWN && !thisObj->being_dragged && thisObj->val_trackbar == 0)
+		{
+			thisObj->point1 = p_img;
+			int idx_rect_sel = thisObj->find_nearest_rect(thisObj->point1);
+			if (idx_rect_sel >= 0)
+			{
+				thisObj->being_dragged = true;
+				thisObj->rect_dragged = thisObj->dr[idx_rect_sel];
+				thisObj->remove_rect(idx_rect_sel);
+				thisObj->record_edit(rectEdit::REMOVE, idx_rect_sel, thisObj->rect_dragged, false);
+				thisObj->add_damage(thisObj->footprint_rect(thisObj->rect_dragged));
+				cv::Rect r = thisObj->view.to_disp(thisObj->rect_dragged);
+				thisObj->set_overlay(overlayShape::RECT, r.tl(), r.br() - cv::Point(1, 1));
+				thisObj->request_redraw();
+			}
+		}
+
+		if (event == CV_EVENT_MOUSEMOVE && thisObj->being_dragged && thisObj->val_trackbar == 0)
+		{
+			cv::Point p = p_img;
+			cv::Rect rec_cur(p.x - thisObj->rect_dragged.width / 2, p.y - thisObj->rect_dragged.height / 2,
+				thisObj->rect_dragged.width, thisObj->rect_dragged.height);
+			cv::Rect r = thisObj->view.to_disp(rec_cur);
+			thisObj->set_overlay(overlayShape::RECT, r.tl(), r.br() - cv::Point(1, 1));
+			thisObj->request_redraw();
+		}
+
+		if (event == CV_EVENT_RBUTTONUP && thisObj->being_dragged && thisObj->val_trackbar == 0)
+		{
+			cv::Point p = p_img;
+			thisObj->being_dragged = false;
+			cv::Rect rec_cur(p.x - thisObj->rect_dragged.width / 2, p.y - thisObj->rect_dragged.height / 2,
+				thisObj->rect_dragged.width, thisObj->rect_dragged.height);
+			thisObj->add_rect(rec_cur);
+			thisObj->record_edit(rectEdit::ADD, static_cast<int>(thisObj->dr.size()) - 1, rec_cur, true);
+			thisObj->add_damage(thisObj->footprint_rect(rec_cur));
+			thisObj->set_overlay(overlayShape::NONE);
+			thisObj->request_redraw();
+		}
+
+	}
+
+	static void CallBackFunc_trackbar(int pos, void* userdata)
+	{
+		manipRect* thisObj = static_cast<manipRect*>(userdata);
+		thisObj->record_event(mouseEvent::EVENT_TRACKBAR, pos, 0, 0);
+		std::lock_guard<std::mutex> lock(thisObj->mtx_state);
+		thisObj->val_trackbar = pos;
+	}
+
+	// undo (z or Ctrl+Z) and redo (y or Ctrl+Y); recorded like the mouse
+	// events, so that a session replays to the same rectangles
+	static void CallBackFunc_key(int key, void* userdata)
+	{
+		manipRect* thisObj = static_cast<manipRect*>(userdata);
+		thisObj->record_event(mouseEvent::EVENT_KEY, key, 0, 0);
+		if (key == 'z' || key == 26) thisObj->undo();
+		else if (key == 'y' || key == 25) thisObj->redo();
+	}
+
+};
+
+
+// source of the pixels of a (possibly huge) image, read one region at a
+// time so that an image never has to be held in memory in full just to be
+// displayed. tileReader_mat serves an image that is already decoded and
+// tileReader_dzi a Deep Zoom image pyramid on disk; a reader for another
+// tiled file format (e.g. tiled TIFF through libtiff) only has to
+// implement the three pure virtual methods below.
+class tileReader
+{
+public:
+	virtual ~tileReader() {}
+	virtual cv::Size size() const = 0;
+	virtual int type() const = 0; // OpenCV type of the pixels, e.g. CV_8UC3
+	// the pixels of roi (within the image) at full resolution
+	virtual cv::Mat read(const cv::Rect &roi) = 0;
+	// the pixels of roi within the image downscaled by 2^level (sizes
+	// rounded up), for readers that have the downscaled levels stored;
+	// empty otherwise, and tileCache makes them from the level below
+	virtual cv::Mat read_level(int /*level*/, const cv::Rect & /*roi*/) { return cv::Mat(); }
+};
+
+class tileReader_mat : public tileReader
+{
+public:
+	tileReader_mat(const cv::Mat &img_) : img(img_) {}
+	cv::Size size() const override { return img.size(); }
+	int type() const override { return img.type(); }
+	cv::Mat read(const cv::Rect &roi) override { return img(roi); }
+private:
+	cv::Mat img;
+};
+
+// a Deep Zoom image (as made by e.g. "vips dzsave" or deepzoom.py): the
+// descriptor name.dzi gives the size of the image, the tile size, the
+// overlap between tiles and their format, and the tiles of level L are in
+// name_files/L/col_row.format. Level max_level is the full resolution and
+// each level below is half the size of the one above (rounded up), so
+// level max_level - l is level l of tileCache. Only the tiles that overlap
+// the region asked for are decoded; nothing is cached here, tileCache
+// caches what it makes of them. read() and read_level() may be called from
+// several threads.
+class tileReader_dzi : public tileReader
+{
+public:
+
+	tileReader_dzi(const std::string &fpath_dzi_)
+	{
+		std::ifstream fs(fpath_dzi_);
+		std::stringstream ss;
+		ss << fs.rdbuf();
+		std::string xml = ss.str();
+		std::string format = attribute(xml, "Format");
+		size_tile = std::atoi(attribute(xml, "TileSize").c_str());
+		overlap = std::atoi(attribute(xml, "Overlap").c_str());
+		size_img = cv::Size(std::atoi(attribute(xml, "Width").c_str()), std::atoi(attribute(xml, "Height").c_str()));
+		if (!fs || format.empty() || size_tile <= 0 || overlap < 0 || size_img.area() <= 0)
+		{
+			printf("ERROR: %s is not a Deep Zoom descriptor\n", fpath_dzi_.c_str());
+			throw std::runtime_error("");
+		}
+		ext = "." + format;
+		dir_tiles = fpath_dzi_.substr(0, fpath_dzi_.size() - 4) + "_files/";
+		max_level = 0;
+		while ((1 << max_level) < std::max(size_img.width, size_img.height))
+			max_level++;
+	}
+
+	// whether fpath is a Deep Zoom descriptor, by its extension
+	static bool is_dzi(const std::string &fpath)
+	{
+		if (fpath.size() < 4) return false;
+		std::string ext_ = fpath.substr(fpath.size() - 4);
+		std::transform(ext_.begin(), ext_.end(), ext_.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		return ext_ == ".dzi";
+	}
+
+	cv::Size size() const override { return size_img; }
+	int type() const override { return CV_8UC3; }
+
+	cv::Mat read(const cv::Rect &roi) override { return read_level(0, roi); }
+
+	cv::Mat read_level(int level, const cv::Rect &roi) override
+	{
+		int L = max_level - level;
+		if (L < 0 || roi.area() <= 0) return cv::Mat();
+		cv::Mat out = cv::Mat::zeros(roi.size(), CV_8UC3);
+		for (int row = roi.y / size_tile; row <= (roi.y + roi.height - 1) / size_tile; row++)
+			for (int col = roi.x / size_tile; col <= (roi.x + roi.width - 1) / size_tile; col++)
+			{
+				std::string fpath_tile = fmt::sprintf("%s%d/%d_%d%s", dir_tiles, L, col, row, ext);
+				cv::Mat tile;
+				try { tile = cv::imread(fpath_tile, cv::IMREAD_COLOR); }
+				catch (const cv::Exception &e) { cout << "Failed to decode " << fpath_tile << ": " << e.what() << endl; }
+				if (tile.empty())
+				{
+					cout << "Cannot read tile " << fpath_tile << "; left black" << endl;
+					continue;
+				}
+				// all but the first row and column of tiles start overlap pixels early
+				cv::Point tl_tile(col * size_tile - (col > 0 ? overlap : 0), row * size_tile - (row > 0 ? overlap : 0));
+				cv::Rect r = cv::Rect(tl_tile, tile.size()) & roi;
+				if (r.area() <= 0) continue;
+				cv::Mat dst = out(r - roi.tl());
+				tile(r - tl_tile).copyTo(dst);
+			}
+		return out;
+	}
+
+private:
+	cv::Size size_img;
+	int size_tile, overlap;
+	int max_level;
+	std::string dir_tiles; // with "/" at the end
+	std::string ext;
+
+	// value of the first attribute name="..." in xml; empty if none
+	static std::string attribute(const std::string &xml, const std::string &name)
+	{
+		size_t pos = xml.find(" " + name + "=\"");
+		if (pos == std::string::npos) return "";
+		pos += name.size() + 3;
+		size_t end = xml.find('"', pos);
+		return end == std::string::npos ? "" : xml.substr(pos, end - pos);
+	}
+};
+
+std::vector<cv::Rect> getRect_user::get_dr(tileReader &reader, const std::vector<cv::Rect> &dr_init)
+{
+	cv::Size size_img = reader.size();
+	return get_dr(reader.read(cv::Rect(0, 0, size_img.width, size_img.height)), dr_init);
+}
+
+// pyramid of fixed size tiles of an image, made on demand from a
+// tileReader and kept in a least recently used cache. Level l is the image
+// downscaled by 2^l. A tile of level l > 0 is read from the reader if it
+// has that level stored (tileReader::read_level), and otherwise made from
+// (at most) four tiles of level l - 1, so each full resolution region is
+// read only once however the user zooms.
+class tileCache
+{
+public:
+
+	tileCache(int size_tile_ = 512, size_t capacity_ = 256)
+	{
+		size_tile = size_tile_;
+		capacity = std::max(capacity_, size_t(16));
+		reader = nullptr;
+	}
+
+	void reset(tileReader *reader_)
+	{
+		reader = reader_;
+		lru.clear();
+		lookup.clear();
+	}
+
+	// tile (tx, ty) of the given level; tiles at the right and bottom
+	// edges are smaller than size_tile
+	cv::Mat get(int level, int tx, int ty)
+	{
+		uint64_t key = (static_cast<uint64_t>(level) << 56) | (static_cast<uint64_t>(tx) << 28) | static_cast<uint64_t>(ty);
+		std::unordered_map<uint64_t, std::list<std::pair<uint64_t, cv::Mat>>::iterator>::iterator it = lookup.find(key);
+		if (it != lookup.end())
+		{
+			lru.splice(lru.begin(), lru, it->second);
+			return it->second->second;
+		}
+
+		cv::Size size_l = size_level(level);
+		cv::Rect roi = cv::Rect(tx * size_tile, ty * size_tile, size_tile, size_tile) & cv::Rect(0, 0, size_l.width, size_l.height);
+		cv::Mat tile;
+		if (level == 0)
+			tile = reader->read(roi);
+		else
+			tile = reader->read_level(level, roi);
+		if (tile.empty() && level > 0)
+		{
+			// put together the tiles below and halve them
+			cv::Size size_below = size_level(level - 1);
+			cv::Rect roi_below = cv::Rect(2 * roi.x, 2 * roi.y, 2 * roi.width, 2 * roi.height) & cv::Rect(0, 0, size_below.width, size_below.height);
+			cv::Mat below(roi_below.size(), reader->type());
+			for (int j = 0; j < 2; j++)
+				for (int i = 0; i < 2; i++)
+				{
+					cv::Rect r_child = cv::Rect((2 * tx + i) * size_tile, (2 * ty + j) * size_tile, size_tile, size_tile) & roi_below;
+					if (r_child.area() <= 0) continue;
+					cv::Mat dst = below(r_child - roi_below.tl());
+					get(level - 1, 2 * tx + i, 2 * ty + j).copyTo(dst);
+				}
+			cv::resize(below, tile, roi.size(), 0, 0, cv::INTER_AREA);
+		}
+
+		lru.push_front(std::make_pair(key, tile));
+		lookup[key] = lru.begin();
+		if (lru.size() > capacity)
+		{
+			lookup.erase(lru.back().first);
+			lru.pop_back();
+		}
+		return tile;
+	}
+
+	int get_size_tile() const { return size_tile; }
+
+	// size of the image at a level, i.e. its size divided by 2^level, rounded up
+	cv::Size size_level(int level) const
+	{
+		cv::Size size_img = reader->size();
+		int f = 1 << level;
+		return cv::Size((size_img.width + f - 1) / f, (size_img.height + f - 1) / f);
+	}
+
+	// number of levels, the last being the first where the image fits in one tile
+	int n_levels() const
+	{
+		int level = 0;
+		cv::Size size_l = size_level(0);
+		while (std::max(size_l.width, size_l.height) > size_tile && level < 30)
+			size_l = size_level(++level);
+		return level + 1;
+	}
+
+private:
+	int size_tile;
+	size_t capacity; // in tiles
+	tileReader *reader;
+	std::list<std::pair<uint64_t, cv::Mat>> lru; // most recently used first
+	std::unordered_map<uint64_t, std::list<std::pair<uint64_t, cv::Mat>>::iterator> lookup;
+};
+
+// annotation of very large images (aerial photographs, pathology scans,
+// ...) through a viewport with pan and zoom. Only the tiles of the image
+// pyramid that are visible are read, cached and drawn, and the displayed
+// frame is always the size of the window, whatever the size of the image.
+// Rectangles are drawn as in getRect_1click_drag (click at a corner and
+// drag) and are returned in full resolution image coordinates.
+// Right click and drag pans; the mouse wheel zooms about the cursor and the
+// '+' and '-' keys about the centre of the view. Any other key finishes.
+// (The view has its own zoom, so set_display_scale/fit have no effect here.)
+class getRect_tiled : public getRect_user
+{
+public:
+
+	getRect_tiled(const cv::Size &size_view_ = cv::Size(1280, 800),
+		std::string name_win_ = "Get rectangles from user",
+		int thickness_rect_ = 2, cv::Scalar color_rect_ = cv::Scalar(255, 0, 0, 0))
+	{
+		size_view = size_view_;
+		name_win = name_win_;
+		thickness_rect = thickness_rect_;
+		color_rect = color_rect_;
+		reader = nullptr;
+	}
+
+	std::vector<cv::Rect> get_dr(const cv::Mat &img) override
+	{
+		return get_dr(img, std::vector<cv::Rect>());
+	}
+
+	std::vector<cv::Rect> get_dr(const cv::Mat &img, const std::vector<cv::Rect> &dr_init) override
+	{
+		tileReader_mat reader_img(img);
+		std::vector<cv::Rect> dr_img = get_dr(reader_img, dr_init);
+		reader = nullptr;
+		return dr_img;
+	}
+
+	// for images that are read region by region instead of being decoded in full
+	std::vector<cv::Rect> get_dr(tileReader &reader_)
+	{
+		return get_dr(reader_, std::vector<cv::Rect>());
+	}
+
+	std::vector<cv::Rect> get_dr(tileReader &reader_, const std::vector<cv::Rect> &dr_init) override
+	{
+		reset(reader_);
+		dr = dr_init;
+		cv::namedWindow(name_win);
+		render();
+		cv::setMouseCallback(name_win, CallBackFunc, this);
+		while (true)
+		{
+			int key = cv::waitKey(0);
+			cv::Point centre(size_view.width / 2, size_view.height / 2);
+			if (key == '+' || key == '=')
+				zoom_at(centre, 1.25);
+			else if (key == '-' || key == '_')
+				zoom_at(centre, 0.8);
+			else
+				break;
+			render();
+		}
+		return dr;
+	}
+
+	void reset(tileReader &reader_)
+	{
+		reader = &reader_;
+		tiles.reset(reader);
+		cv::Size size_img = reader->size();
+		// start with the whole image in view
+		zoom_min = std::min(static_cast<double>(size_view.width) / size_img.width,
+			static_cast<double>(size_view.height) / size_img.height);
+		zoom_max = std::max(8.0, zoom_min);
+		zoom = zoom_min;
+		origin = cv::Point2d(0, 0);
+		frame.create(size_view, reader->type());
+		dr.clear(); dr.reserve(30);
+		being_dragged = false;
+		being_panned = false;
+		events_recorded.clear();
+	}
+
+	void reset(const cv::Mat &img) override
+	{
+		reader_own.reset(new tileReader_mat(img));
+		reset(*reader_own);
+	}
+
+	void feed_event(int event, int x, int y, int flags) override { CallBackFunc(event, x, y, flags, this); }
+	std::vector<cv::Rect> get_dr_current() override { return dr; }
+
+	cv::Mat get_img_drawn() { return frame; }
+
+	// zoom by factor, keeping the image point under p_disp (frame coordinates) in place
+	void zoom_at(const cv::Point &p_disp, double factor)
+	{
+		cv::Point2d p_img = to_img_d(p_disp);
+		zoom = std::min(std::max(zoom * factor, zoom_min), zoom_max);
+		origin = cv::Point2d(p_img.x - p_disp.x / zoom, p_img.y - p_disp.y / zoom);
+		clamp_view();
+	}
+
+	// move the view by delta_disp frame pixels
+	void pan(const cv::Point &delta_disp)
+	{
+		origin = cv::Point2d(origin.x - delta_disp.x / zoom, origin.y - delta_disp.y / zoom);
+		clamp_view();
+	}
+
+	// image coordinates of a frame pixel and vice versa
+	cv::Point to_img(const cv::Point &p_disp) const
+	{
+		cv::Point2d p = to_img_d(p_disp);
+		return cv::Point(static_cast<int>(std::floor(p.x)), static_cast<int>(std::floor(p.y)));
+	}
+
+	cv::Rect to_disp(const cv::Rect &r) const
+	{
+		int u0 = static_cast<int>(std::round((r.x - origin.x) * zoom));
+		int v0 = static_cast<int>(std::round((r.y - origin.y) * zoom));
+		int u1 = static_cast<int>(std::round((r.x + r.width - origin.x) * zoom));
+		int v1 = static_cast<int>(std::round((r.y + r.height - origin.y) * zoom));
+		return cv::Rect(u0, v0, u1 - u0, v1 - v0);
+	}
+
+	//==========================================//
+	// Public data members: not for users to call directly; for CallBackFunc static method
+	//==========================================//
+	std::string name_win;
+	int thickness_rect;
+	cv::Scalar color_rect;
+	std::vector<cv::Rect> dr; // in full resolution image coordinates
+	cv::Size size_view; // size of the displayed frame
+	cv::Mat frame; // what is displayed: the visible part of the image and rectangles
+	cv::Mat tile_temp; // reused when scaling tiles into the frame
+	overlayCanvas overlay; // for the rectangle being dragged
+	tileReader *reader;
+	std::unique_ptr<tileReader> reader_own; // when reset from a cv::Mat
+	tileCache tiles;
+	cv::Point2d origin; // image coordinates of the top left corner of the frame
+	double zoom, zoom_min, zoom_max; // frame pixels per image pixel
+	bool being_dragged, being_panned;
+	cv::Point point1, point2; // frame coordinates
+
+	cv::Point2d to_img_d(const cv::Point &p_disp) const
+	{
+		return cv::Point2d(origin.x + p_disp.x / zoom, origin.y + p_disp.y / zoom);
+	}
+
+	// keep the view within the image (or the image at the top left of the
+	// view when it is smaller than the view)
+	void clamp_view()
+	{
+		cv::Size size_img = reader->size();
+		double w = size_view.width / zoom, h = size_view.height / zoom;
+		origin.x = std::max(0.0, std::min(origin.x, size_img.width - w));
+		origin.y = std::max(0.0, std::min(origin.y, size_img.height - h));
+	}
+
+	// compose the frame from the visible tiles and draw the rectangles in view
+	void render()
+	{
+		frame.setTo(cv::Scalar::all(0));
+		// the level whose resolution is just above the display resolution
+		int level = 0;
+		while (level + 1 < tiles.n_levels() && std::ldexp(1.0, level + 1) * zoom <= 1.0)
+			level++;
+		double s = std::ldexp(1.0, level); // image pixels per pixel of the level
+		int T = tiles.get_size_tile();
+		cv::Size size_l = tiles.size_level(level);
+		int tx0 = std::max(0, static_cast<int>(origin.x / s) / T);
+		int ty0 = std::max(0, static_cast<int>(origin.y / s) / T);
+		int tx1 = std::min((size_l.width - 1) / T, static_cast<int>((origin.x + size_view.width / zoom) / s) / T);
+		int ty1 = std::min((size_l.height - 1) / T, static_cast<int>((origin.y + size_view.height / zoom) / s) / T);
+		for (int ty = ty0; ty <= ty1; ty++)
+			for (int tx = tx0; tx <= tx1; tx++)
+				draw_tile(tiles.get(level, tx, ty), tx * T * s, ty * T * s, s);
+
+		cv::Rect rect_frame(0, 0, frame.cols, frame.rows);
+		for (size_t i = 0; i < dr.size(); i++)
+		{
+			cv::Rect r = to_disp(dr[i]);
+			if (((r + cv::Size(1, 1)) & rect_frame).area() > 0)
+				cv::rectangle(frame, r, color_rect, thickness_rect);
+		}
+		show(name_win, frame);
+	}
+
+	// draw into the frame the visible part of a tile whose top left pixel is
+	// at (x0, y0) in the image and whose pixels each cover s x s image pixels
+	void draw_tile(const cv::Mat &tile, double x0, double y0, double s)
+	{
+		// visible part of the tile, in whole tile pixels
+		int sx0 = std::max(0, static_cast<int>(std::floor((origin.x - x0) / s)));
+		int sy0 = std::max(0, static_cast<int>(std::floor((origin.y - y0) / s)));
+		int sx1 = std::min(tile.cols, static_cast<int>(std::ceil((origin.x + size_view.width / zoom - x0) / s)));
+		int sy1 = std::min(tile.rows, static_cast<int>(std::ceil((origin.y + size_view.height / zoom - y0) / s)));
+		if (sx1 <= sx0 || sy1 <= sy0) return;
+		// where these pixels land in the frame; exact at their edges, so
+		// the tiles line up with each other and with the rectangles
+		int u0 = static_cast<int>(std::round((x0 + sx0 * s - origin.x) * zoom));
+		int v0 = static_cast<int>(std::round((y0 + sy0 * s - origin.y) * zoom));
+		int u1 = static_cast<int>(std::round((x0 + sx1 * s - origin.x) * zoom));
+		int v1 = static_cast<int>(std::round((y0 + sy1 * s - origin.y) * zoom));
+		if (u1 <= u0 || v1 <= v0) return;
+		cv::resize(tile(cv::Rect(sx0, sy0, sx1 - sx0, sy1 - sy0)), tile_temp, cv::Size(u1 - u0, v1 - v0), 0, 0,
+			zoom * s < 1 ? cv::INTER_AREA : cv::INTER_NEAREST);
+		cv::Rect dst(u0, v0, u1 - u0, v1 - v0);
+		cv::Rect dst_in = dst & cv::Rect(0, 0, frame.cols, frame.rows);
+		if (dst_in.area() <= 0) return;
+		cv::Mat frame_dst = frame(dst_in);
+		tile_temp(dst_in - dst.tl()).copyTo(frame_dst);
+	}
+
+private:
+
+	static void CallBackFunc(int event, int x, int y, int flags, void* userdata)
+	{
+		getRect_tiled* thisObj = static_cast<getRect_tiled*>(userdata);
+		thisObj->record_event(event, x, y, flags);
+
+		if (event == CV_EVENT_LBUTTONDOWN && !thisObj->being_dragged && !thisObj->being_panned)
+		{
+			thisObj->point1 = cv::Point(x, y);
+			thisObj->being_dragged = true;
+		}
+
+		if (event == CV_EVENT_MOUSEMOVE && thisObj->being_dragged)
+		{
+			thisObj->point2 = cv::Point(x, y);
+			thisObj->overlay.draw_rect(thisObj->frame, thisObj->point1, thisObj->point2, thisObj->color_rect, thisObj->thickness_rect);
+			thisObj->show(thisObj->name_win, thisObj->frame);
+			thisObj->overlay.restore(thisObj->frame);
+		}
+
+		if (event == CV_EVENT_LBUTTONUP && thisObj->being_dragged)
+		{
+			thisObj->point2 = cv::Point(x, y);
+			thisObj->being_dragged = false;
+			thisObj->dr.push_back(cv::Rect(thisObj->to_img(thisObj->point1), thisObj->to_img(thisObj->point2)));
+			cv::rectangle(thisObj->frame, thisObj->to_disp(thisObj->dr.back()), thisObj->color_rect, thisObj->thickness_rect);
+			thisObj->show(thisObj->name_win, thisObj->frame);
+		}
+
+		if (event == CV_EVENT_RBUTTONDOWN && !thisObj->being_dragged)
+		{
+			thisObj->point1 = cv::Point(x, y);
+			thisObj->being_panned = true;
+		}
+
+		if (event == CV_EVENT_MOUSEMOVE && thisObj->being_panned)
+		{
+			thisObj->pan(cv::Point(x, y) - thisObj->point1);
+			thisObj->point1 = cv::Point(x, y);
+			thisObj->render();
+		}
+
+		if (event == CV_EVENT_RBUTTONUP && thisObj->being_panned)
+			thisObj->being_panned = false;
+
+		if (event == CV_EVENT_MOUSEWHEEL && !thisObj->being_dragged)
+		{
+			thisObj->zoom_at(cv::Point(x, y), cv::getMouseWheelDelta(flags) > 0 ? 1.25 : 0.8);
+			thisObj->render();
+		}
+	}
+};
+
+// a getRect_user that needs no window, for batch runs and benchmarks on
+// machines without a display. It works in one of two ways:
+// (1) for the k-th image given to get_dr, return the k-th saved vector of rectangles.
+// (2) for the k-th image, replay the k-th recorded stream of mouse events
+// into another getRect_user implementation running headless, i.e. through
+// its usual callback logic, and return the rectangles it ends up with.
+// The streams can be recorded from a normal session with set_record_events
+// (see also annotate_obj_det_dataset::set_record_session).
+class getRect_replay : public getRect_user
+{
+public:
+
+	getRect_replay() = delete;
+
+	getRect_replay(const std::vector<std::vector<cv::Rect>> &dr_all_)
+	{
+		dr_all = dr_all_;
+		getRect_target = nullptr;
+		idx_img = 0;
+	}
+
+	getRect_replay(getRect_user &getRect_target_, const std::vector<std::vector<mouseEvent>> &events_all_)
+	{
+		events_all = events_all_;
+		getRect_target = &getRect_target_;
+		idx_img = 0;
+	}
+
+	std::vector<cv::Rect> get_dr(const cv::Mat &img) override
+	{
+		return get_dr(img, std::vector<cv::Rect>());
+	}
+
+	// dr_init is passed on to the target, so that a session annotated on
+	// top of pre-annotations replays the same
+	std::vector<cv::Rect> get_dr(const cv::Mat &img, const std::vector<cv::Rect> &dr_init) override
+	{
+		reset(img, dr_init);
+		if (getRect_target != nullptr && idx_img < events_all.size())
+		{
+			const std::vector<mouseEvent> &events = events_all[idx_img];
+			for (size_t i = 0; i < events.size(); i++)
+				feed_event(events[i].event, events[i].x, events[i].y, events[i].flags);
+		}
+		if (idx_img == n_images())
+			cout << "WARNING: getRect_replay has no more recorded images; returning no rectangles" << endl;
+		std::vector<cv::Rect> dr = get_dr_current();
+		idx_img++;
+		return dr;
+	}
+
+	// saved rectangles need no pixels, so a tiled image is not read at all
+	std::vector<cv::Rect> get_dr(tileReader &reader, const std::vector<cv::Rect> &dr_init) override
+	{
+		if (getRect_target == nullptr) return get_dr(cv::Mat(), dr_init);
+		return getRect_user::get_dr(reader, dr_init);
+	}
+
+	void reset(const cv::Mat &img) override { reset(img, std::vector<cv::Rect>()); }
+
+	void reset(const cv::Mat &img, const std::vector<cv::Rect> &dr_init) override
+	{
+		if (getRect_target != nullptr)
+		{
+			getRect_target->set_headless(true);
+			getRect_target->reset(img, dr_init);
+		}
+		events_recorded.clear();
+	}
+
+	void feed_event(int event, int x, int y, int flags) override
+	{
+		record_event(event, x, y, flags);
+		if (getRect_target != nullptr)
+			getRect_target->feed_event(event, x, y, flags);
+	}
+
+	std::vector<cv::Rect> get_dr_current() override
+	{
+		if (getRect_target != nullptr)
+			return getRect_target->get_dr_current();
+		if (idx_img < dr_all.size())
+			return dr_all[idx_img];
+		return std::vector<cv::Rect>();
+	}
+
+	// number of images for which something was recorded
+	size_t n_images() const { return getRect_target != nullptr ? events_all.size() : dr_all.size(); }
+
+	// start again from the first recorded image
+	void rewind() { idx_img = 0; }
+
+	// text format: one line per image, "n x y w h x y w h ..." with n rectangles
+	static void save_dr_all(const std::string &fpath, const std::vector<std::vector<cv::Rect>> &dr_all_)
+	{
+		std::ofstream fs(fpath);
+		if (!fs)
+		{
+			printf("ERROR: cannot open %s for writing\n", fpath.c_str());
+			throw std::runtime_error("");
+		}
+		for (size_t i = 0; i < dr_all_.size(); i++)
+		{
+			fs << dr_all_[i].size();
+			for (size_t j = 0; j < dr_all_[i].size(); j++)
+				fs << " " << dr_all_[i][j].x << " " << dr_all_[i][j].y << " " << dr_all_[i][j].width << " " << dr_all_[i][j].height;
+			fs << "\n";
+		}
+	}
+
+	static std::vector<std::vector<cv::Rect>> load_dr_all(const std::string &fpath)
+	{
+		std::ifstream fs(fpath);
+		if (!fs)
+		{
+			printf("ERROR: cannot open %s\n", fpath.c_str());
+			throw std::runtime_error("");
+		}
+		std::vector<std::vector<cv::Rect>> dr_all_;
+		size_t n;
+		while (fs >> n)
+		{
+			std::vector<cv::Rect> dr(n);
+			for (size_t j = 0; j < n; j++)
+				fs >> dr[j].x >> dr[j].y >> dr[j].width >> dr[j].height;
+			dr_all_.push_back(dr);
+		}
+		return dr_all_;
+	}
+
+	// text format: one line per image, "n event x y flags event x y flags ..." with n events
+	static void save_events_all(const std::string &fpath, const std::vector<std::vector<mouseEvent>> &events_all_)
+	{
+		std::ofstream fs(fpath);
+		if (!fs)
+		{
+			printf("ERROR: cannot open %s for writing\n", fpath.c_str());
+			throw std::runtime_error("");
+		}
+		for (size_t i = 0; i < events_all_.size(); i++)
+		{
+			fs << events_all_[i].size();
+			for (size_t j = 0; j < events_all_[i].size(); j++)
+				fs << " " << events_all_[i][j].event << " " << events_all_[i][j].x << " " << events_all_[i][j].y << " " << events_all_[i][j].flags;
+			fs << "\n";
+		}
+	}
+
+	static std::vector<std::vector<mouseEvent>> load_events_all(const std::string &fpath)
+	{
+		std::ifstream fs(fpath);
+		if (!fs)
+		{
+			printf("ERROR: cannot open %s\n", fpath.c_str());
+			throw std::runtime_error("");
+		}
+		std::vector<std::vector<mouseEvent>> events_all_;
+		size_t n;
+		while (fs >> n)
+		{
+			std::vector<mouseEvent> events(n);
+			for (size_t j = 0; j < n; j++)
+				fs >> events[j].event >> events[j].x >> events[j].y >> events[j].flags;
+			events_all_.push_back(events);
+		}
+		return events_all_;
+	}
+
+private:
+	std::vector<std::vector<cv::Rect>> dr_all;
+	std::vector<std::vector<mouseEvent>> events_all;
+	getRect_user *getRect_target;
+	size_t idx_img;
+};
+
+// the list of image files in a directory (optionally including all its
+// subdirectories), obtained with one pass over the directory tree by
+// several threads at once. The list can be cached in a manifest file
+// holding the size and modification time of every image and the
+// modification time of every directory. On later runs a directory whose
+// modification time is unchanged is taken from the manifest without being
+// listed again, so only directories where files were added, removed or
+// renamed are rescanned. (Images overwritten in place keep their cached
+// size and time; the list itself is always correct.)
+class imageManifest
+{
+public:
+
+	struct entry
+	{
+		std::string fpath;
+		uint64_t size;
+		int64_t mtime;
+	};
+
+	imageManifest() = delete;
+
+	// make sure that "dir_root_" has "/" at the end
+	imageManifest(const std::string &dir_root_, bool recursive_ = false, int n_threads_ = 8)
+	{
+		dir_root = dir_root_;
+		recursive = recursive_;
+		n_threads = std::max(n_threads_, 1);
+	}
+
+	// scan the directory tree; if fpath_cache is given, use the manifest
+	// there (if any) to skip unchanged directories and then update it
+	void build(const std::string &fpath_cache = "")
+	{
+		dirs_cached.clear();
+		if (!fpath_cache.empty()) load_cache(fpath_cache);
+
+		dirs.clear();
+		queue.clear();
+		queue.push_back("");
+		n_busy = 0;
+		n_reused = 0;
+		std::vector<std::thread> workers;
+		for (int i = 0; i < n_threads; i++)
+			workers.push_back(std::thread(&imageManifest::worker, this));
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+		dirs_cached.clear();
+
+		entries.clear();
+		for (std::map<std::string, dirRecord>::const_iterator it = dirs.begin(); it != dirs.end(); ++it)
+			for (size_t i = 0; i < it->second.files.size(); i++)
+			{
+				entry e = it->second.files[i];
+				e.fpath = dir_root + (it->first.empty() ? "" : it->first + "/") + e.fpath;
+				entries.push_back(e);
+			}
+		std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) { return a.fpath < b.fpath; });
+
+		if (!fpath_cache.empty()) save_cache(fpath_cache);
+		if (n_reused > 0)
+			cout << "Image manifest: " << n_reused << " of " << dirs.size() << " directories unchanged since last scan" << endl;
+	}
+
+	const std::vector<entry>& get_entries() const { return entries; }
+
+	std::vector<std::string> get_fpaths() const
+	{
+		std::vector<std::string> fpaths(entries.size());
+		for (size_t i = 0; i < entries.size(); i++)
+			fpaths[i] = entries[i].fpath;
+		return fpaths;
+	}
+
+	// png, jpg, jpeg, tif, tiff or dzi (a Deep Zoom descriptor; any case)
+	static bool is_image_file(const std::string &fname)
+	{
+		size_t pos = fname.find_last_of('.');
+		if (pos == std::string::npos) return false;
+		std::string ext = fname.substr(pos + 1);
+		std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		return ext == "png" || ext == "jpg" || ext == "jpeg" || ext == "tif" || ext == "tiff" || ext == "dzi";
+	}
+
+private:
+
+	struct dirRecord
+	{
+		int64_t mtime;
+		std::vector<entry> files; // fpath holds just the file name
+		std::vector<std::string> subdirs; // names
+	};
+
+	std::string dir_root;
+	bool recursive;
+	int n_threads;
+	std::vector<entry> entries;
+
+	// state of a scan; keys are directory paths relative to dir_root ("" for dir_root)
+	std::map<std::string, dirRecord> dirs_cached, dirs;
+	std::deque<std::string> queue;
+	int n_busy; // workers currently listing a directory
+	int n_reused;
+	std::mutex mtx;
+	std::condition_variable cv_queue;
+
+	static int64_t mtime_of(const std::filesystem::file_time_type &t) { return static_cast<int64_t>(t.time_since_epoch().count()); }
+
+	void worker()
+	{
+		while (true)
+		{
+			std::string dir_rel;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				// done when nothing is queued and nobody can queue more
+				cv_queue.wait(lock, [this] { return !queue.empty() || n_busy == 0; });
+				if (queue.empty()) return;
+				dir_rel = queue.front();
+				queue.pop_front();
+				n_busy++;
+			}
+
+			dirRecord rec;
+			bool reused = scan_dir(dir_rel, rec);
+
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				for (size_t i = 0; i < rec.subdirs.size(); i++)
+					queue.push_back(dir_rel.empty() ? rec.subdirs[i] : dir_rel + "/" + rec.subdirs[i]);
+				dirs[dir_rel] = std::move(rec);
+				if (reused) n_reused++;
+				n_busy--;
+			}
+			cv_queue.notify_all();
+		}
+	}
+
+	// list one directory into rec, or take it from the cache if it is
+	// unchanged; returns true in the latter case
+	bool scan_dir(const std::string &dir_rel, dirRecord &rec)
+	{
+		std::filesystem::path dir = std::filesystem::u8path(dir_root + dir_rel);
+		std::error_code ec;
+		rec.mtime = mtime_of(std::filesystem::last_write_time(dir, ec));
+		if (ec)
+		{
+			cout << "Cannot access directory " << dir.u8string() << "; skipping" << endl;
+			return false;
+		}
+
+		// dirs_cached is not modified while the workers run
+		std::map<std::string, dirRecord>::const_iterator it = dirs_cached.find(dir_rel);
+		if (it != dirs_cached.end() && it->second.mtime == rec.mtime)
+		{
+			rec.files = it->second.files;
+			if (recursive) rec.subdirs = it->second.subdirs;
+			return true;
+		}
+
+		for (std::filesystem::directory_iterator di(dir, ec), end; !ec && di != end; di.increment(ec))
+		{
+			std::string name = di->path().filename().u8string();
+			std::error_code ec_entry;
+			if (recursive && di->is_directory(ec_entry))
+			{
+				// links to directories are not followed: one may lead back up
+				// the tree and list the same images again and again
+				if (!di->is_symlink(ec_entry)) rec.subdirs.push_back(name);
+			}
+			else if (di->is_regular_file(ec_entry) && is_image_file(name))
+			{
+				entry e;
+				e.fpath = name;
+				e.size = di->file_size(ec_entry);
+				e.mtime = mtime_of(di->last_write_time(ec_entry));
+				rec.files.push_back(e);
+			}
+		}
+		return false;
+	}
+
+	// manifest format (text): an "R <0|1>" line saying whether the scan was
+	// recursive, then a "D <mtime> <dir>" line per directory, followed by an
+	// "F <size> <mtime> <name>" line per image and an "S <name>" line per
+	// subdirectory in it. The root directory is written as ".". A manifest
+	// of a scan that was not recursive has no subdirectories, so it is not
+	// used for a recursive one (nor the other way round).
+	void load_cache(const std::string &fpath_cache)
+	{
+		std::ifstream fs(fpath_cache);
+		if (!fs) return; // first run
+		std::string line, dir_cur;
+		dirRecord *rec = nullptr;
+		int recursive_cached = -1;
+		while (std::getline(fs, line))
+		{
+			if (line.size() < 2 || line[1] != ' ') continue;
+			std::istringstream ss(line.substr(2));
+			if (line[0] == 'R')
+				ss >> recursive_cached;
+			else if (line[0] == 'D')
+			{
+				int64_t mtime;
+				ss >> mtime;
+				ss.get();
+				std::getline(ss, dir_cur);
+				if (dir_cur == ".") dir_cur = "";
+				rec = &dirs_cached[dir_cur];
+				rec->mtime = mtime;
+			}
+			else if (line[0] == 'F' && rec != nullptr)
+			{
+				entry e;
+				ss >> e.size >> e.mtime;
+				ss.get();
+				std::getline(ss, e.fpath);
+				rec->files.push_back(e);
+			}
+			else if (line[0] == 'S' && rec != nullptr)
+				rec->subdirs.push_back(line.substr(2));
+		}
+		if (recursive_cached != (recursive ? 1 : 0))
+		{
+			cout << "Image manifest " << fpath_cache << " is not of a " << (recursive ? "recursive" : "non-recursive") << " scan; rescanning" << endl;
+			dirs_cached.clear();
+		}
+	}
+
+	void save_cache(const std::string &fpath_cache)
+	{
+		std::string fpath_tmp = fpath_cache + ".tmp";
+		{
+			std::ofstream fs(fpath_tmp);
+			if (!fs)
+			{
+				cout << "Cannot write image manifest " << fpath_tmp << endl;
+				return;
+			}
+			fs << "R " << (recursive ? 1 : 0) << "\n";
+			for (std::map<std::string, dirRecord>::const_iterator it = dirs.begin(); it != dirs.end(); ++it)
+			{
+				fs << "D " << it->second.mtime << " " << (it->first.empty() ? "." : it->first) << "\n";
+				for (size_t i = 0; i < it->second.files.size(); i++)
+					fs << "F " << it->second.files[i].size << " " << it->second.files[i].mtime << " " << it->second.files[i].fpath << "\n";
+				for (size_t i = 0; i < it->second.subdirs.size(); i++)
+					fs << "S " << it->second.subdirs[i] << "\n";
+			}
+		}
+		// replaces the previous manifest in one step
+		std::error_code ec;
+		std::filesystem::rename(fpath_tmp, fpath_cache, ec);
+		if (ec) cout << "Cannot write image manifest " << fpath_cache << endl;
+	}
+};
+
+// proposes rectangles on an image for the user to correct (see
+// annotate_obj_det_dataset::set_pre_annotator). propose() is called from
+// the threads of imgPrefetcher, possibly several at a time.
+class preAnnotator
+{
+public:
+	virtual ~preAnnotator() {}
+	virtual std::vector<cv::Rect> propose(const cv::Mat &img) = 0;
+};
+
+// OpenCV's HOG + linear SVM people detector
+class preAnnotator_hog : public preAnnotator
+{
+public:
+
+	preAnnotator_hog(double hit_threshold_ = 0, double scale_ = 1.05,
+		const cv::Size &win_stride_ = cv::Size(8, 8), double group_threshold_ = 2)
+	{
+		hog.setSVMDetector(cv::HOGDescriptor::getDefaultPeopleDetector());
+		hit_threshold = hit_threshold_;
+		scale = scale_;
+		win_stride = win_stride_;
+		group_threshold = group_threshold_;
+	}
+
+	std::vector<cv::Rect> propose(const cv::Mat &img) override
+	{
+		std::vector<cv::Rect> found;
+		hog.detectMultiScale(img, found, hit_threshold, win_stride, cv::Size(), scale, group_threshold);
+		return found;
+	}
+
+private:
+	cv::HOGDescriptor hog; // detectMultiScale is const, so it can be shared by threads
+	double hit_threshold;
+	double scale;
+	cv::Size win_stride;
+	double group_threshold;
+};
+
+// any detection network that cv::dnn can read (Caffe, TensorFlow, Darknet,
+// ONNX, ...) whose output is SSD style: N rows of [image id, class id,
+// confidence, left, top, right, bottom], the corners relative to the image
+// size. Runs on the CPU. A cv::dnn::Net runs one forward pass at a time,
+// so calls from several threads take turns.
+class preAnnotator_dnn : public preAnnotator
+{
+public:
+
+	// class_id_ = -1 keeps the detections of every class
+	preAnnotator_dnn(const std::string &fpath_model, const std::string &fpath_config = "",
+		const cv::Size &size_input_ = cv::Size(300, 300), double scale_ = 1.0 / 127.5,
+		const cv::Scalar &mean_ = cv::Scalar(127.5, 127.5, 127.5), bool swap_rb_ = true,
+		float min_confidence_ = 0.5f, int class_id_ = -1)
+	{
+		net = cv::dnn::readNet(fpath_model, fpath_config);
+		if (net.empty())
+		{
+			printf("ERROR: cannot read the network %s\n", fpath_model.c_str());
+			throw std::runtime_error("");
+		}
+		net.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+		net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+		size_input = size_input_;
+		scale = scale_;
+		mean = mean_;
+		swap_rb = swap_rb_;
+		min_confidence = min_confidence_;
+		class_id = class_id_;
+	}
+
+	std::vector<cv::Rect> propose(const cv::Mat &img) override
+	{
+		cv::Mat blob = cv::dnn::blobFromImage(img, scale, size_input, mean, swap_rb, false);
+		cv::Mat out;
+		{
+			std::lock_guard<std::mutex> lock(mtx_net);
+			net.setInput(blob);
+			out = net.forward();
+		}
+		cv::Mat det = out.reshape(1, static_cast<int>(out.total() / 7));
+		std::vector<cv::Rect> found;
+		cv::Rect rect_img(0, 0, img.cols, img.rows);
+		for (int i = 0; i < det.rows; i++)
+		{
+			const float *d = det.ptr<float>(i);
+			if (d[2] < min_confidence) continue;
+			if (class_id >= 0 && static_cast<int>(d[1]) != class_id) continue;
+			cv::Rect r = cv::Rect(cv::Point(static_cast<int>(d[3] * img.cols), static_cast<int>(d[4] * img.rows)),
+				cv::Point(static_cast<int>(d[5] * img.cols), static_cast<int>(d[6] * img.rows))) & rect_img;
+			if (r.area() > 0) found.push_back(r);
+		}
+		return found;
+	}
+
+private:
+	cv::dnn::Net net;
+	std::mutex mtx_net;
+	cv::Size size_input;
+	double scale;
+	cv::Scalar mean;
+	bool swap_rb;
+	float min_confidence;
+	int class_id;
+};
+
+// an image decoded by imgPrefetcher
+struct prefetchedImg
+{
+	std::string fpath;
+	cv::Mat img;
+	int reduce; // img is decoded at 1/reduce of the full resolution
+	std::vector<cv::Rect> dr_proposed; // by the preAnnotator, if any
+	bool skipped = false; // claimed by another worker; nothing was decoded
+	std::shared_ptr<tileReader> tiled; // for a Deep Zoom image, which is not decoded (img is empty)
+
+	// open fpath as a tiled image if it is one; false if it is not, or if
+	// it cannot be opened (then img and tiled are both left empty)
+	bool open_tiled()
+	{
+		if (!tileReader_dzi::is_dzi(fpath)) return false;
+		try { tiled = std::make_shared<tileReader_dzi>(fpath); }
+		catch (const std::exception &) { cout << "Cannot open " << fpath << " as a Deep Zoom image" << endl; }
+		return tiled != nullptr;
+	}
+};
+
+// decodes the upcoming images of a list on worker threads so that the
+// annotation loop does not have to wait for cv::imread. At most n_prefetch
+// images beyond the one last requested are decoded ahead (bounded queue), so
+// memory use does not grow with the size of the dataset.
+// With reduce_ = 2, 4 or 8 the images are decoded at that fraction of their
+// resolution (see flags_reduced). With a pre_annotator_ (not owned) its
+// proposals are computed on the same threads, right after decoding, so
+// they are ready as early as the image. With claim_, an image is only
+// decoded if claim_(idx) returns true (see workClaims); otherwise it comes
+// out skipped. Deep Zoom images are only opened (see prefetchedImg::tiled),
+// never reduced nor pre-annotated.
+class imgPrefetcher
+{
+public:
+
+	imgPrefetcher(const std::vector<std::string> &fpaths_, int n_prefetch_ = 4,
+		int n_threads_ = 2, int flags_imread_ = cv::IMREAD_COLOR, int reduce_ = 1,
+		preAnnotator *pre_annotator_ = nullptr, latencyTrace *trace_ = nullptr,
+		std::function<bool(size_t)> claim_ = nullptr)
+	{
+		fpaths = fpaths_;
+		claim = claim_;
+		pre_annotator = pre_annotator_;
+		trace = trace_;
+		n_prefetch = std::max(n_prefetch_, 1);
+		reduce = reduce_;
+		flags_imread = flags_reduced(flags_imread_, reduce);
+		idx_next_decode = 0;
+		idx_consume = 0;
+		stopping = false;
+		for (int i = 0; i < std::max(n_threads_, 1); i++)
+			workers.push_back(std::thread(&imgPrefetcher::worker, this));
+	}
+
+	~imgPrefetcher()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		cv_space.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	// get the decoded image at index idx of the list, blocking until it
+	// is ready. Images should be requested in increasing order; skipping
+	// ahead is allowed and discards whatever was decoded in between.
+	prefetchedImg get(size_t idx)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		idx_consume = idx;
+		// nobody has started on this one yet; move the decode front here
+		if (idx_next_decode < idx) idx_next_decode = idx;
+		done.erase(done.begin(), done.lower_bound(idx));
+		cv_space.notify_all();
+		cv_ready.wait(lock, [this, idx] { return done.count(idx) > 0; });
+		prefetchedImg item = std::move(done[idx]);
+		done.erase(idx);
+		return item;
+	}
+
+	// cv::imread flags (IMREAD_COLOR or IMREAD_GRAYSCALE) for decoding at
+	// 1/reduce (1, 2, 4 or 8) of the full resolution. JPEG decoders scale in
+	// the DCT domain and skip most of the work of a full decode; other
+	// formats are decoded in full and then resized.
+	static int flags_reduced(int flags, int reduce)
+	{
+		bool gray = flags == cv::IMREAD_GRAYSCALE;
+		switch (reduce)
+		{
+		case 1: return flags;
+		case 2: return gray ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_REDUCED_COLOR_2;
+		case 4: return gray ? cv::IMREAD_REDUCED_GRAYSCALE_4 : cv::IMREAD_REDUCED_COLOR_4;
+		case 8: return gray ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8;
+		default:
+			printf("ERROR: reduce must be 1, 2, 4 or 8\n");
+			throw std::runtime_error("");
+		}
+	}
+
+private:
+
+	std::vector<std::string> fpaths;
+	int n_prefetch;
+	int reduce;
+	int flags_imread;
+	preAnnotator *pre_annotator;
+	latencyTrace *trace; // "decode" and "propose" are recorded here; may be nullptr
+	std::function<bool(size_t)> claim;
+
+	std::vector<std::thread> workers;
+	std::mutex mtx;
+	std::condition_variable cv_space; // signalled when the consumer moves on
+	std::condition_variable cv_ready; // signalled when an image is decoded
+	std::map<size_t, prefetchedImg> done; // decoded, not yet consumed
+	size_t idx_next_decode; // next index for a worker to pick up
+	size_t idx_consume; // index last requested by the consumer
+	bool stopping;
+
+	void worker()
+	{
+		while (true)
+		{
+			size_t idx;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cv_space.wait(lock, [this] { return stopping || idx_next_decode >= fpaths.size() ||
+					idx_next_decode <= idx_consume + n_prefetch; });
+				if (stopping || idx_next_decode >= fpaths.size()) return;
+				idx = idx_next_decode++;
+			}
+
+			prefetchedImg item;
+			item.fpath = fpaths[idx];
+			item.reduce = reduce;
+			item.skipped = claim && !claim(idx);
+			if (!item.skipped && !item.open_tiled())
+			{
+				latencyTrace::scope t(trace, "decode", static_cast<long long>(idx));
+				try { item.img = cv::imread(fpaths[idx], flags_imread); }
+				catch (const cv::Exception &e) { cout << "Failed to decode " << fpaths[idx] << ": " << e.what() << endl; }
+			}
+			if (pre_annotator && !item.img.empty())
+			{
+				latencyTrace::scope t(trace, "propose", static_cast<long long>(idx));
+				try { item.dr_proposed = pre_annotator->propose(item.img); }
+				catch (const cv::Exception &e) { cout << "Pre-annotation failed for " << fpaths[idx] << ": " << e.what() << endl; }
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				// the consumer may have skipped past this one meanwhile
+				if (idx >= idx_consume) done[idx] = std::move(item);
+			}
+			cv_ready.notify_all();
+		}
+	}
+};
+
+// a fixed set of threads running queued jobs. The queue is bounded: submit()
+// blocks while it is full, so a fast producer cannot run arbitrarily far
+// ahead of the workers (backpressure).
+class workerPool
+{
+public:
+
+	workerPool(int n_threads_ = 2, size_t capacity_ = 64)
+	{
+		capacity = std::max(capacity_, size_t(1));
+		n_running = 0;
+		stopping = false;
+		for (int i = 0; i < std::max(n_threads_, 1); i++)
+			workers.push_back(std::thread(&workerPool::worker, this));
+	}
+
+	// finishes all queued jobs before returning
+	~workerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		cv_job.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	// queue a job; blocks while the queue is full
+	void submit(std::function<void()> job)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv_space.wait(lock, [this] { return jobs.size() < capacity; });
+		jobs.push_back(std::move(job));
+		lock.unlock();
+		cv_job.notify_one();
+	}
+
+	// block until every job submitted so far has finished
+	void wait_idle()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv_idle.wait(lock, [this] { return jobs.empty() && n_running == 0; });
+	}
+
+	int n_threads() const { return static_cast<int>(workers.size()); }
+
+private:
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	size_t capacity;
+	int n_running;
+	bool stopping;
+	std::mutex mtx;
+	std::condition_variable cv_job; // signalled when a job is queued
+	std::condition_variable cv_space; // signalled when a job is taken off the queue
+	std::condition_variable cv_idle; // signalled when a job finishes
+
+	void worker()
+	{
+		while (true)
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cv_job.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (jobs.empty()) return; // stopping and nothing left to do
+				job = std::move(jobs.front());
+				jobs.pop_front();
+				n_running++;
+			}
+			cv_space.notify_one();
+			// a job that throws must not take the process down with it
+			try { job(); }
+			catch (const std::exception &e) { cout << "A background job failed: " << e.what() << endl; }
+			catch (...) { cout << "A background job failed" << endl; }
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				n_running--;
+			}
+			cv_idle.notify_all();
+		}
+	}
+};
+
+// writes image patches to disk on a workerPool so that encoding does not
+// hold up the annotation loop. The file name of each patch is decided by
+// the caller when it is queued, so the output is exactly the same as
+// writing the patches one after another.
+class patchWriter
+{
+public:
+
+	patchWriter(int n_threads_ = 4, size_t capacity_ = 256) : pool(n_threads_, capacity_)
+	{
+		n_written = 0;
+		n_failed = 0;
+		trace = nullptr;
+	}
+
+	// queue a patch to be written to fpath. The patch may be a view into a
+	// larger image; the image is kept alive until the patch has been written.
+	// id is only used to record the write into the trace, if any. An empty
+	// patch is not written and counts as failed.
+	void write(const std::string &fpath, const cv::Mat &patch, int id = 0)
+	{
+		if (patch.empty())
+		{
+			n_failed++;
+			return;
+		}
+		pool.submit([this, fpath, patch, id]() {
+			latencyTrace::scope t(trace, "write", id);
+			bool ok = false;
+			try { ok = cv::imwrite(fpath, patch); }
+			catch (const cv::Exception &e) { cout << "Failed to write " << fpath << ": " << e.what() << endl; }
+			if (ok) n_written++; else n_failed++;
+		});
+	}
+
+	// block until all queued patches have been written
+	void flush() { pool.wait_idle(); }
+
+	void set_trace(latencyTrace *trace_) { trace = trace_; }
+
+	int get_n_written() const { return n_written; }
+	int get_n_failed() const { return n_failed; }
+
+private:
+	workerPool pool;
+	std::atomic<int> n_written;
+	std::atomic<int> n_failed;
+	latencyTrace *trace;
+};
+
+// where annotate_obj_det_dataset puts the patches it extracts. Patches are
+// numbered 1, 2, ... and the sink decides where patch number id goes. put()
+// may be called from several threads and may return before the patch is
+// stored; flush() blocks until everything put so far is stored.
+class patchSink
+{
+public:
+	patchSink() : trace(nullptr) {}
+	virtual ~patchSink() {}
+	virtual void put(int id, const cv::Mat &patch) = 0;
+	// patches numbered id_first, id_first + 1, ... (e.g. those of one image)
+	virtual void put_batch(int id_first, const std::vector<cv::Mat> &patches)
+	{
+		for (size_t i = 0; i < patches.size(); i++)
+			put(id_first + static_cast<int>(i), patches[i]);
+	}
+	virtual void flush() = 0;
+	virtual int get_n_written() const = 0;
+	virtual int get_n_failed() const = 0;
+	// patches not stored because the same patch already was
+	virtual int get_n_existing() const { return 0; }
+
+	// wait until every patch put so far is in its file (as far as the
+	// process is concerned: a crash then loses none of them). May be called
+	// from any thread, while other threads put more.
+	virtual void wait_stored() { flush(); }
+
+	// record the time each patch takes to be encoded and written ("write",
+	// by patch number; by batch for patchSink_npy) into trace_
+	virtual void set_trace(latencyTrace *trace_) { trace = trace_; }
+
+	// resize patches to size_out in one go on OpenCV's thread pool. The
+	// results are stacked in batch, a single contiguous image of
+	// n x size_out.height rows, and returned as views into it. An empty
+	// patch (e.g. from a click without a drag) stays empty and its rows of
+	// batch are left as they are.
+	static std::vector<cv::Mat> resize_batch(const std::vector<cv::Mat> &patches, const cv::Size &size_out, int type, cv::Mat &batch)
+	{
+		batch.create(static_cast<int>(patches.size()) * size_out.height, size_out.width, type);
+		std::vector<cv::Mat> resized(patches.size());
+		for (size_t i = 0; i < patches.size(); i++)
+			if (!patches[i].empty())
+				resized[i] = batch.rowRange(static_cast<int>(i) * size_out.height, static_cast<int>(i + 1) * size_out.height);
+		cv::parallel_for_(cv::Range(0, static_cast<int>(patches.size())), [&](const cv::Range &range) {
+			for (int i = range.start; i < range.end; i++)
+				if (!patches[i].empty())
+					cv::resize(patches[i], resized[i], size_out, 0, 0, cv::INTER_AREA);
+		});
+		return resized;
+	}
+
+protected:
+	latencyTrace *trace;
+};
+
+// patches as PNG files named "%05d.png" by their number in dir_output (the
+// original output of annotate_obj_det_dataset), optionally resized to
+// size_out first
+class patchSink_png : public patchSink
+{
+public:
+
+	patchSink_png(const std::string &dir_output_, int n_threads_ = 4, size_t capacity_ = 256,
+		const cv::Size &size_out_ = cv::Size())
+		: writer(n_threads_, capacity_)
+	{
+		dir_output = dir_output_;
+		size_out = size_out_;
+	}
+
+	void put(int id, const cv::Mat &patch) override
+	{
+		cv::Mat patch_out = patch;
+		if (size_out.area() > 0 && !patch.empty())
+			cv::resize(patch, patch_out, size_out, 0, 0, cv::INTER_AREA);
+		writer.write(fmt::sprintf("%s%05d.png", dir_output, id), patch_out, id);
+	}
+
+	void put_batch(int id_first, const std::vector<cv::Mat> &patches) override
+	{
+		if (size_out.area() <= 0 || patches.empty())
+		{
+			patchSink::put_batch(id_first, patches);
+			return;
+		}
+		cv::Mat batch; // kept alive by the views until they are written
+		std::vector<cv::Mat> resized = resize_batch(patches, size_out, patches[0].type(), batch);
+		for (size_t i = 0; i < resized.size(); i++)
+			writer.write(fmt::sprintf("%s%05d.png", dir_output, id_first + static_cast<int>(i)), resized[i], id_first + static_cast<int>(i));
+	}
+
+	void set_trace(latencyTrace *trace_) override
+	{
+		patchSink::set_trace(trace_);
+		writer.set_trace(trace_);
+	}
+
+	void flush() override { writer.flush(); }
+	int get_n_written() const override { return writer.get_n_written(); }
+	int get_n_failed() const override { return writer.get_n_failed(); }
+
+private:
+	std::string dir_output;
+	cv::Size size_out; // (0, 0) to keep the patches as they are
+	patchWriter writer;
+};
+
+// patches as PNG files in dir_output named by a 64 bit hash of their pixels
+// ("%016llx.png") instead of by their number, so that the same patch always
+// gets the same name whatever the order of the images or of the writes. A
+// patch whose file already exists is not written again: the names in
+// dir_output are loaded into a hash set when the sink is created, so
+// exporting again, or exporting an overlapping set of images, only writes
+// the new patches. A patch is written to a temporary name and renamed
+// when complete, so a crash never leaves a truncated file under a final
+// name. Hashing, resizing and encoding run on a workerPool. Empty patches
+// are counted as failed.
+class patchSink_hashed : public patchSink
+{
+public:
+
+	patchSink_hashed(const std::string &dir_output_, int n_threads_ = 4, size_t capacity_ = 256,
+		const cv::Size &size_out_ = cv::Size())
+		: pool(n_threads_, capacity_)
+	{
+		dir_output = dir_output_;
+		size_out = size_out_;
+		n_written = 0;
+		n_failed = 0;
+		n_existing = 0;
+		load_existing();
+	}
+
+	~patchSink_hashed() { flush(); }
+
+	void put(int id, const cv::Mat &patch) override
+	{
+		if (patch.empty())
+		{
+			n_failed++;
+			return;
+		}
+		pool.submit([this, id, patch]() {
+			latencyTrace::scope t(trace, "write", id);
+			uint64_t h = hash_patch(patch, size_out);
+			{
+				std::lock_guard<std::mutex> lock(mtx_hashes);
+				if (!hashes.insert(h).second) { n_existing++; return; }
+			}
+			cv::Mat patch_out = patch;
+			if (size_out.area() > 0)
+				cv::resize(patch, patch_out, size_out, 0, 0, cv::INTER_AREA);
+			std::string fpath = fmt::sprintf("%s%016llx.png", dir_output, h);
+			std::string fpath_tmp = fmt::sprintf("%s%016llx.tmp.png", dir_output, h);
+			bool ok = false;
+			try { ok = cv::imwrite(fpath_tmp, patch_out); }
+			catch (const cv::Exception &e) { cout << "Failed to write " << fpath_tmp << ": " << e.what() << endl; }
+			std::error_code ec;
+			if (ok) std::filesystem::rename(fpath_tmp, fpath, ec);
+			ok = ok && !ec;
+			if (!ok) std::filesystem::remove(fpath_tmp, ec);
+			if (ok) n_written++;
+			else
+			{
+				n_failed++;
+				std::lock_guard<std::mutex> lock(mtx_hashes);
+				hashes.erase(h); // so that a later copy can try again
+			}
+		});
+	}
+
+	void flush() override { pool.wait_idle(); }
+	int get_n_written() const override { return n_written; }
+	int get_n_failed() const override { return n_failed; }
+
+	int get_n_existing() const override { return n_existing; }
+
+	// hash of the pixels of patch (which may be a view into a larger image),
+	// of its size and type and of size_out_, 8 bytes at a time
+	static uint64_t hash_patch(const cv::Mat &patch, const cv::Size &size_out_)
+	{
+		uint64_t h = 14695981039346656037ULL;
+		h = mix(h, (static_cast<uint64_t>(patch.rows) << 32) | static_cast<uint32_t>(patch.cols));
+		h = mix(h, (static_cast<uint64_t>(size_out_.height) << 32) | static_cast<uint32_t>(size_out_.width));
+		h = mix(h, static_cast<uint64_t>(patch.type()));
+		size_t n_bytes_row = static_cast<size_t>(patch.cols) * patch.elemSize();
+		for (int y = 0; y < patch.rows; y++)
+		{
+			const uchar *row = patch.ptr<uchar>(y);
+			size_t k = 0;
+			for (; k + 8 <= n_bytes_row; k += 8)
+			{
+				uint64_t w;
+				std::memcpy(&w, row + k, 8);
+				h = mix(h, w);
+			}
+			uint64_t w = 0;
+			std::memcpy(&w, row + k, n_bytes_row - k);
+			h = mix(h, w ^ (static_cast<uint64_t>(n_bytes_row - k) << 56));
+		}
+		// final avalanche (splitmix64)
+		h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+		h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+		h ^= h >> 31;
+		return h;
+	}
+
+private:
+	std::string dir_output;
+	cv::Size size_out; // (0, 0) to keep the patches as they are
+	std::unordered_set<uint64_t> hashes; // of the patches in dir_output
+	std::mutex mtx_hashes;
+	std::atomic<int> n_written;
+	std::atomic<int> n_failed;
+	std::atomic<int> n_existing;
+	workerPool pool; // last, so that it finishes its jobs before the rest is destroyed
+
+	static uint64_t mix(uint64_t h, uint64_t w)
+	{
+		h ^= w * 0x9e3779b97f4a7c15ULL;
+		h = (h << 31) | (h >> 33);
+		return h * 0xff51afd7ed558ccdULL;
+	}
+
+	// names of the form "%016llx.png" already in dir_output; temporary
+	// files left by a crash are removed
+	void load_existing()
+	{
+		std::error_code ec;
+		std::vector<std::filesystem::path> tmps;
+		std::filesystem::directory_iterator it(dir_output, ec), end;
+		for (; !ec && it != end; it.increment(ec))
+		{
+			std::string fname = it->path().filename().string();
+			if (fname.find_first_not_of("0123456789abcdef") != 16) continue;
+			if (fname.size() == 24 && fname.compare(16, 8, ".tmp.png") == 0)
+				tmps.push_back(it->path());
+			else if (fname.size() == 20 && fname.compare(16, 4, ".png") == 0)
+				hashes.insert(std::stoull(fname.substr(0, 16), nullptr, 16));
+		}
+		for (size_t i = 0; i < tmps.size(); i++)
+			std::filesystem::remove(tmps[i], ec);
+		if (!hashes.empty())
+			cout << hashes.size() << " patches already in " << dir_output << endl;
+	}
+};
+
+// all patches, resized to size_out, packed in a single uint8 tensor of shape
+// N x height x width x channels in NumPy's .npy format, so that a training
+// loader can memory map it (numpy.load(fpath, mmap_mode='r')) with no
+// decoding at all. Patch number id is at index id - 1 and N is the largest
+// number put; numbers never put are left as zeros. The header has a fixed
+// size and is rewritten with the final N by flush() and the destructor.
+// Empty patches and those whose type does not have n_channels_ 8 bit
+// channels are left as zeros and counted as failed.
+class patchSink_npy : public patchSink
+{
+public:
+
+	patchSink_npy(const std::string &fpath_, const cv::Size &size_out_, int n_channels_ = 3, int n_threads_ = 2)
+		: pool(n_threads_, 4 * std::max(n_threads_, 1))
+	{
+		fpath = fpath_;
+		size_out = size_out_;
+		n_channels = n_channels_;
+		n_patches = 0;
+		n_written = 0;
+		n_failed = 0;
+		fs.open(fpath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+		if (!fs.is_open())
+		{
+			printf("ERROR: could not create %s\n", fpath.c_str());
+			throw std::runtime_error("");
+		}
+		write_header();
+	}
+
+	~patchSink_npy() { flush(); }
+
+	void put(int id, const cv::Mat &patch) override
+	{
+		put_batch(id, std::vector<cv::Mat>(1, patch));
+	}
+
+	// the patches are resized straight into their rows of the tensor, which
+	// are then written with a single write
+	void put_batch(int id_first, const std::vector<cv::Mat> &patches) override
+	{
+		if (patches.empty()) return;
+		pool.submit([this, id_first, patches]() {
+			latencyTrace::scope t(trace, "write", id_first);
+			int type = CV_8UC(n_channels);
+			std::vector<cv::Mat> ok(patches.size());
+			int n_bad = 0;
+			for (size_t i = 0; i < patches.size(); i++)
+			{
+				bool good = patches[i].type() == type && !patches[i].empty();
+				ok[i] = good ? patches[i] : cv::Mat::zeros(size_out, type);
+				if (!good) n_bad++;
+			}
+			cv::Mat batch;
+			resize_batch(ok, size_out, type, batch);
+			{
+				std::lock_guard<std::mutex> lock(mtx_file);
+				fs.seekp(static_cast<std::streamoff>(size_header + (id_first - 1) * bytes_patch()));
+				fs.write(reinterpret_cast<const char*>(batch.data), batch.total() * batch.elemSize());
+				n_patches = std::max(n_patches, static_cast<size_t>(id_first - 1 + patches.size()));
+			}
+			n_written += static_cast<int>(patches.size()) - n_bad;
+			n_failed += n_bad;
+		});
+	}
+
+	void flush() override
+	{
+		pool.wait_idle();
+		std::lock_guard<std::mutex> lock(mtx_file);
+		// ids never put at the end of the file would make it too short
+		fs.seekp(0, std::ios::end);
+		std::streamoff size_file = fs.tellp();
+		std::streamoff size_data = static_cast<std::streamoff>(size_header + n_patches * bytes_patch());
+		if (size_file < size_data)
+		{
+			fs.seekp(size_data - 1);
+			fs.put(0);
+		}
+		write_header();
+		fs.flush();
+	}
+
+	int get_n_written() const override { return n_written; }
+	int get_n_failed() const override { return n_failed; }
+
+private:
+
+	static const size_t size_header = 128; // a multiple of 64, as .npy requires
+
+	std::string fpath;
+	cv::Size size_out;
+	int n_channels;
+	size_t n_patches; // largest id put so far
+	std::fstream fs;
+	std::mutex mtx_file;
+	std::atomic<int> n_written;
+	std::atomic<int> n_failed;
+	workerPool pool; // last, so that it finishes its jobs before the rest is destroyed
+
+	size_t bytes_patch() const { return static_cast<size_t>(size_out.area()) * n_channels; }
+
+	// .npy version 1.0: magic, version, u16 length of the header dict, then
+	// the dict padded with spaces and ended by a newline
+	void write_header()
+	{
+		std::string dict = fmt::sprintf("{'descr': '|u1', 'fortran_order': False, 'shape': (%d, %d, %d, %d), }",
+			n_patches, size_out.height, size_out.width, n_channels);
+		size_t len_dict = size_header - 10;
+		dict.resize(len_dict - 1, ' ');
+		dict += '\n';
+		std::string header("\x93NUMPY\x01\x00", 8);
+		header += static_cast<char>(len_dict & 0xff);
+		header += static_cast<char>(len_dict >> 8);
+		header += dict;
+		fs.seekp(0);
+		fs.write(header.data(), header.size());
+	}
+};
+
+// entry of the index of patchSink_shards: where the encoded patch number id is
+struct shardIndexEntry
+{
+	int32_t id;
+	uint32_t shard;
+	uint64_t offset; // of the encoded bytes within the shard
+	uint64_t n_bytes;
+};
+
+// patches encoded (PNG by default) and appended to a few large shard files
+// instead of a small file each: prefix-00000.rec, prefix-00001.rec, ...
+// A new shard is started when the current one would exceed max_bytes_shard_.
+// Each record is
+//   char magic[4] = "PREC", i32 id, u64 n_bytes, the encoded patch, zeros to an 8 byte boundary
+// so that a shard can be scanned on its own, and flush() writes prefix.idx:
+//   char magic[4] = "PIDX", u32 version, u64 n, n x shardIndexEntry sorted by id
+// Shards are only ever appended to; the encoding runs on a workerPool. The
+// shards of an earlier session with the same prefix are kept: their records
+// are scanned into the index and the new ones go to the shards after them.
+// recover_index rebuilds a missing or stale index from the shards alone.
+// patchShardReader gives random access by patch number.
+class patchSink_shards : public patchSink
+{
+public:
+
+	patchSink_shards(const std::string &prefix_, size_t max_bytes_shard_ = size_t(256) << 20,
+		const std::string &ext_ = ".png", int n_threads_ = 4, size_t capacity_ = 256,
+		const cv::Size &size_out_ = cv::Size())
+		: pool(n_threads_, capacity_)
+	{
+		prefix = prefix_;
+		// offsets within a shard must fit the long of fseek
+		max_bytes_shard = std::min(max_bytes_shard_, size_t(0x7fffffff));
+		ext = ext_;
+		size_out = size_out_;
+		f = nullptr;
+		bytes_shard = 0;
+		n_written = 0;
+		n_failed = 0;
+		shard = 0;
+		while (scan_shard(prefix, shard, index))
+			shard++;
+	}
+
+	~patchSink_shards()
+	{
+		flush();
+		if (f) std::fclose(f);
+	}
+
+	void put(int id, const cv::Mat &patch) override
+	{
+		cv::Mat patch_out = patch;
+		if (size_out.area() > 0 && !patch.empty())
+			cv::resize(patch, patch_out, size_out, 0, 0, cv::INTER_AREA);
+		encode_append(id, patch_out);
+	}
+
+	void put_batch(int id_first, const std::vector<cv::Mat> &patches) override
+	{
+		if (size_out.area() <= 0 || patches.empty())
+		{
+			patchSink::put_batch(id_first, patches);
+			return;
+		}
+		cv::Mat batch;
+		std::vector<cv::Mat> resized = resize_batch(patches, size_out, patches[0].type(), batch);
+		for (size_t i = 0; i < resized.size(); i++)
+			encode_append(id_first + static_cast<int>(i), resized[i]);
+	}
+
+	// also writes the index, so the shards written so far can be read
+	void flush() override
+	{
+		pool.wait_idle();
+		std::lock_guard<std::mutex> lock(mtx_file);
+		if (f) std::fflush(f);
+		write_index(prefix, index);
+	}
+
+	// without writing the index: the records are found again by scanning
+	// the shards (see recover_index)
+	void wait_stored() override
+	{
+		pool.wait_idle();
+		std::lock_guard<std::mutex> lock(mtx_file);
+		if (f) std::fflush(f);
+	}
+
+	int get_n_written() const override { return n_written; }
+	int get_n_failed() const override { return n_failed; }
+
+	static std::string shard_path(const std::string &prefix, int shard) { return fmt::sprintf("%s-%05d.rec", prefix, shard); }
+	static std::string index_path(const std::string &prefix) { return prefix + ".idx"; }
+
+	// rebuild the index of the shards of prefix from their record headers,
+	// e.g. when the session that wrote them was killed before its last
+	// flush(), write it to prefix.idx and return it
+	static std::vector<shardIndexEntry> recover_index(const std::string &prefix)
+	{
+		std::vector<shardIndexEntry> index;
+		for (int shard = 0; scan_shard(prefix, shard, index); shard++);
+		write_index(prefix, index);
+		return index;
+	}
+
+private:
+
+	struct recordHeader { char magic[4]; int32_t id; uint64_t n_bytes; };
+
+	std::string prefix, ext;
+	size_t max_bytes_shard;
+	cv::Size size_out; // (0, 0) to keep the patches as they are
+	FILE *f; // current shard
+	int shard; // number of the current shard
+	size_t bytes_shard; // bytes written to the current shard
+	std::vector<shardIndexEntry> index;
+	std::mutex mtx_file;
+	std::atomic<int> n_written;
+	std::atomic<int> n_failed;
+	workerPool pool; // last, so that it finishes its jobs before the rest is destroyed
+
+	// an empty patch, or one that cannot be encoded or appended, counts as
+	// failed; nothing here throws, as it runs on the pool
+	void encode_append(int id, const cv::Mat &patch)
+	{
+		if (patch.empty())
+		{
+			n_failed++;
+			return;
+		}
+		pool.submit([this, id, patch]() {
+			latencyTrace::scope t(trace, "write", id);
+			std::vector<uchar> bytes;
+			bool ok = false;
+			try { ok = cv::imencode(ext, patch, bytes); }
+			catch (const cv::Exception &e) { cout << "Failed to encode patch " << id << ": " << e.what() << endl; }
+			if (ok) append(id, bytes); else n_failed++;
+		});
+	}
+
+	void append(int id, const std::vector<uchar> &bytes)
+	{
+		static const char zeros[8] = { 0 };
+		std::lock_guard<std::mutex> lock(mtx_file);
+		size_t n_pad = (8 - bytes.size() % 8) % 8;
+		size_t n_record = sizeof(recordHeader) + bytes.size() + n_pad;
+		if (f == nullptr || (bytes_shard > 0 && bytes_shard + n_record > max_bytes_shard))
+		{
+			if (f)
+			{
+				std::fclose(f);
+				shard++;
+			}
+			f = std::fopen(shard_path(prefix, shard).c_str(), "wb");
+			bytes_shard = 0;
+			if (f == nullptr)
+			{
+				// the next patch tries again
+				cout << "Cannot open " << shard_path(prefix, shard) << " for writing; patch " << id << " is lost" << endl;
+				n_failed++;
+				return;
+			}
+		}
+		recordHeader h;
+		std::memcpy(h.magic, "PREC", 4);
+		h.id = id;
+		h.n_bytes = bytes.size();
+		bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1 &&
+			(bytes.empty() || std::fwrite(&bytes[0], 1, bytes.size(), f) == bytes.size()) &&
+			std::fwrite(zeros, 1, n_pad, f) == n_pad;
+		if (!ok)
+		{
+			cout << "Failed to append patch " << id << " to " << shard_path(prefix, shard) << endl;
+			n_failed++;
+			return;
+		}
+		index.push_back(shardIndexEntry{ id, static_cast<uint32_t>(shard), bytes_shard + sizeof(recordHeader), bytes.size() });
+		bytes_shard += n_record;
+		n_written++;
+	}
+
+	// add to index the records of shard number shard of prefix, up to the
+	// first one that is not whole (the end of a shard cut short by a crash);
+	// false if there is no such shard
+	static bool scan_shard(const std::string &prefix, int shard, std::vector<shardIndexEntry> &index)
+	{
+		FILE *fs = std::fopen(shard_path(prefix, shard).c_str(), "rb");
+		if (fs == nullptr) return false;
+		std::fseek(fs, 0, SEEK_END);
+		long n_bytes_file = std::max(std::ftell(fs), 0L);
+		long offset = 0;
+		recordHeader h;
+		while (std::fseek(fs, offset, SEEK_SET) == 0 && std::fread(&h, sizeof(h), 1, fs) == 1 &&
+			std::memcmp(h.magic, "PREC", 4) == 0 && h.n_bytes <= static_cast<uint64_t>(n_bytes_file))
+		{
+			uint64_t n_record = sizeof(recordHeader) + h.n_bytes + (8 - h.n_bytes % 8) % 8;
+			if (n_record > static_cast<uint64_t>(n_bytes_file - offset)) break;
+			index.push_back(shardIndexEntry{ h.id, static_cast<uint32_t>(shard), offset + sizeof(recordHeader), h.n_bytes });
+			offset += static_cast<long>(n_record);
+		}
+		std::fclose(fs);
+		return true;
+	}
+
+	// write index, sorted by id, to prefix.idx (through a temporary file, as
+	// annotationStore::save). A failure is reported and the previous index,
+	// if any, is kept; flush() and the destructor call this, so it does not
+	// throw.
+	static void write_index(const std::string &prefix, std::vector<shardIndexEntry> &index)
+	{
+		// a patch put twice is found at its last copy
+		std::stable_sort(index.begin(), index.end(), [](const shardIndexEntry &a, const shardIndexEntry &b) { return a.id < b.id; });
+		std::string fpath = index_path(prefix), fpath_tmp = fpath + ".tmp";
+		FILE *fi = std::fopen(fpath_tmp.c_str(), "wb");
+		if (fi == nullptr)
+		{
+			cout << "Cannot open " << fpath_tmp << " for writing; shard index not written" << endl;
+			return;
+		}
+		uint32_t version = 1;
+		uint64_t n = index.size();
+		bool ok = std::fwrite("PIDX", 1, 4, fi) == 4 && std::fwrite(&version, sizeof(version), 1, fi) == 1 &&
+			std::fwrite(&n, sizeof(n), 1, fi) == 1 &&
+			(index.empty() || std::fwrite(&index[0], sizeof(shardIndexEntry), index.size(), fi) == index.size());
+		ok = std::fclose(fi) == 0 && ok;
+		if (!ok)
+		{
+			cout << "Failed to write shard index " << fpath_tmp << endl;
+			std::remove(fpath_tmp.c_str());
+			return;
+		}
+		std::error_code ec;
+		std::filesystem::rename(fpath_tmp, fpath, ec);
+		if (ec) cout << "Failed to rename " << fpath_tmp << " to " << fpath << endl;
+	}
+};
+
+// random access by number to the patches written by patchSink_shards. The
+// index is read in one go (and rebuilt from the shards if it is missing or
+// not valid); shards are opened when first needed. The read methods may be
+// called from several threads.
+class patchShardReader
+{
+public:
+
+	patchShardReader(const std::string &prefix_)
+	{
+		prefix = prefix_;
+		if (read_index()) return;
+		cout << "No valid shard index " << patchSink_shards::index_path(prefix) << "; rebuilding it from the shards" << endl;
+		index = patchSink_shards::recover_index(prefix);
+		std::error_code ec;
+		if (index.empty() && !std::filesystem::exists(patchSink_shards::shard_path(prefix, 0), ec))
+		{
+			printf("ERROR: no shards found with prefix %s\n", prefix.c_str());
+			throw std::runtime_error("");
+		}
+	}
+
+	~patchShardReader()
+	{
+		for (size_t i = 0; i < files.size(); i++)
+			if (files[i]) std::fclose(files[i]);
+	}
+
+	size_t size() const { return index.size(); }
+
+	// numbers of all the patches, in increasing order
+	std::vector<int> ids() const
+	{
+		std::vector<int> v;
+		v.reserve(index.size());
+		for (size_t i = 0; i < index.size(); i++)
+			if (v.empty() || v.back() != index[i].id) v.push_back(index[i].id);
+		return v;
+	}
+
+	bool contains(int id) const { return find(id) != nullptr; }
+
+	// the encoded bytes of patch number id; false if there is no such patch
+	// or it cannot be read
+	bool read_encoded(int id, std::vector<uchar> &bytes)
+	{
+		const shardIndexEntry *e = find(id);
+		if (e == nullptr) return false;
+		std::lock_guard<std::mutex> lock(mtx);
+		if (files.size() <= e->shard) files.resize(e->shard + 1, nullptr);
+		FILE *&f = files[e->shard];
+		if (f == nullptr) f = std::fopen(patchSink_shards::shard_path(prefix, e->shard).c_str(), "rb");
+		if (f == nullptr) return false;
+		bytes.resize(e->n_bytes);
+		return std::fseek(f, static_cast<long>(e->offset), SEEK_SET) == 0 &&
+			(bytes.empty() || std::fread(&bytes[0], 1, bytes.size(), f) == bytes.size());
+	}
+
+	// patch number id, decoded; empty if there is no such patch
+	cv::Mat read(int id, int flags = cv::IMREAD_UNCHANGED)
+	{
+		std::vector<uchar> bytes;
+		if (!read_encoded(id, bytes)) return cv::Mat();
+		return cv::imdecode(bytes, flags);
+	}
+
+private:
+
+	std::string prefix;
+	std::vector<shardIndexEntry> index; // sorted by id
+	std::vector<FILE*> files; // by shard number; nullptr until needed
+	std::mutex mtx;
+
+	// read prefix.idx into index; false if it is missing or not valid
+	bool read_index()
+	{
+		FILE *fi = std::fopen(patchSink_shards::index_path(prefix).c_str(), "rb");
+		if (fi == nullptr) return false;
+		std::fseek(fi, 0, SEEK_END);
+		uint64_t n_bytes_file = static_cast<uint64_t>(std::max(std::ftell(fi), 0L));
+		std::fseek(fi, 0, SEEK_SET);
+		char magic[4] = { 0 };
+		uint32_t version = 0;
+		uint64_t n = 0;
+		bool ok = std::fread(magic, 1, 4, fi) == 4 && std::memcmp(magic, "PIDX", 4) == 0 &&
+			std::fread(&version, sizeof(version), 1, fi) == 1 && version == 1 &&
+			std::fread(&n, sizeof(n), 1, fi) == 1 &&
+			n <= n_bytes_file / sizeof(shardIndexEntry) && n_bytes_file == 16 + n * sizeof(shardIndexEntry);
+		if (ok)
+		{
+			index.resize(n);
+			ok = n == 0 || std::fread(&index[0], sizeof(shardIndexEntry), n, fi) == n;
+		}
+		std::fclose(fi);
+		if (!ok) index.clear();
+		return ok;
+	}
+
+	const shardIndexEntry* find(int id) const
+	{
+		std::vector<shardIndexEntry>::const_iterator it = std::upper_bound(index.begin(), index.end(), id,
+			[](int a, const shardIndexEntry &b) { return a < b.id; });
+		if (it == index.begin() || (it - 1)->id != id) return nullptr;
+		return &*(it - 1);
+	}
+};
+
+// compact binary store of the rectangles annotated on each image, keyed by
+// the image path, so that crops, exports and statistics can be regenerated
+// without the GUI (e.g. at a different winsize). load() reads the whole
+// file with a single read and lookups then run in place on it (binary search
+// on the path hashes), so stores with millions of boxes load quickly.
+// File layout (little endian; all sections 8 byte aligned so that the file
+// can equally be memory mapped and used as it is):
+//   header  : char magic[4] = "ANNS", u32 version, u64 n_images, u64 n_rects, u64 n_bytes_paths
+//   index   : n_images x { u64 hash_path, u64 offset_path, u32 len_path, i32 img_w, i32 img_h,
+//             u32 unused, u64 idx_rect_first, u64 n_rects }, sorted by hash_path
+//   rects   : n_rects x { i32 x, i32 y, i32 width, i32 height }
+//   paths   : the image paths, concatenated
+class annotationStore
+{
+public:
+
+	annotationStore() {}
+
+	annotationStore(const std::string &fpath) { load(fpath); }
+
+	// replace the current contents with those of the file fpath
+	void load(const std::string &fpath)
+	{
+		FILE *f = std::fopen(fpath.c_str(), "rb");
+		if (f == nullptr)
+		{
+			printf("ERROR: cannot open annotation store %s\n", fpath.c_str());
+			throw std::runtime_error("");
+		}
+		std::fseek(f, 0, SEEK_END);
+		long n_bytes = std::ftell(f);
+		std::fseek(f, 0, SEEK_SET);
+		buf.resize(std::max(n_bytes, 0L));
+		size_t n_read = buf.empty() ? 0 : std::fread(&buf[0], 1, buf.size(), f);
+		std::fclose(f);
+		changes.clear();
+
+		if (n_read != buf.size() || !valid())
+		{
+			buf.clear();
+			printf("ERROR: %s is not a valid annotation store\n", fpath.c_str());
+			throw std::runtime_error("");
+		}
+	}
+
+	static bool file_exists(const std::string &fpath)
+	{
+		FILE *f = std::fopen(fpath.c_str(), "rb");
+		if (f == nullptr) return false;
+		std::fclose(f);
+		return true;
+	}
+
+	// set the rectangles of an image (replacing any it had)
+	void put(const std::string &fpath_img, const cv::Size &size_img, const std::vector<cv::Rect> &dr)
+	{
+		imageRecord &rec = changes[fpath_img];
+		rec.size_img = size_img;
+		rec.dr = dr;
+	}
+
+	// get the rectangles of an image; false if the image is not in the store
+	bool get(const std::string &fpath_img, std::vector<cv::Rect> &dr, cv::Size *size_img = nullptr) const
+	{
+		std::map<std::string, imageRecord>::const_iterator it = changes.find(fpath_img);
+		if (it != changes.end())
+		{
+			dr = it->second.dr;
+			if (size_img) *size_img = it->second.size_img;
+			return true;
+		}
+		const indexEntry *e = find_loaded(fpath_img);
+		if (e == nullptr) return false;
+		const rectEntry *r = rects() + e->idx_rect_first;
+		dr.resize(e->n_rects);
+		for (size_t i = 0; i < dr.size(); i++)
+			dr[i] = cv::Rect(r[i].x, r[i].y, r[i].width, r[i].height);
+		if (size_img) *size_img = cv::Size(e->img_w, e->img_h);
+		return true;
+	}
+
+	// sorted paths of all the images in the store
+	std::vector<std::string> image_paths() const
+	{
+		std::vector<std::string> paths;
+		size_t n_loaded = buf.empty() ? 0 : header()->n_images;
+		paths.reserve(n_loaded + changes.size());
+		for (size_t i = 0; i < n_loaded; i++)
+		{
+			std::string path = path_loaded(index()[i]);
+			if (changes.count(path) == 0) paths.push_back(path);
+		}
+		for (std::map<std::string, imageRecord>::const_iterator it = changes.begin(); it != changes.end(); ++it)
+			paths.push_back(it->first);
+		std::sort(paths.begin(), paths.end());
+		return paths;
+	}
+
+	// write everything to fpath (through a temporary file, so that a crash
+	// while saving does not destroy the previous version)
+	void save(const std::string &fpath) const
+	{
+		// gather the records to be written: loaded ones not since replaced, and new ones
+		struct item { uint64_t hash; std::string path; cv::Size size_img; const rectEntry *r_loaded; const std::vector<cv::Rect> *r_new; uint64_t n; };
+		std::vector<item> items;
+		size_t n_loaded = buf.empty() ? 0 : header()->n_images;
+		for (size_t i = 0; i < n_loaded; i++)
+		{
+			const indexEntry &e = index()[i];
+			std::string path = path_loaded(e);
+			if (changes.count(path) > 0) continue;
+			items.push_back(item{ e.hash_path, path, cv::Size(e.img_w, e.img_h), rects() + e.idx_rect_first, nullptr, e.n_rects });
+		}
+		for (std::map<std::string, imageRecord>::const_iterator it = changes.begin(); it != changes.end(); ++it)
+			items.push_back(item{ hash_str(it->first), it->first, it->second.size_img, nullptr, &it->second.dr, it->second.dr.size() });
+		std::sort(items.begin(), items.end(), [](const item &a, const item &b) { return a.hash < b.hash || (a.hash == b.hash && a.path < b.path); });
+
+		uint64_t n_rects = 0, n_bytes_paths = 0;
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			n_rects += items[i].n;
+			n_bytes_paths += items[i].path.size();
+		}
+		std::vector<char> out(sizeof(fileHeader) + items.size() * sizeof(indexEntry) + n_rects * sizeof(rectEntry) + n_bytes_paths);
+		fileHeader *h = reinterpret_cast<fileHeader*>(&out[0]);
+		std::memcpy(h->magic, "ANNS", 4);
+		h->version = 1;
+		h->n_images = items.size();
+		h->n_rects = n_rects;
+		h->n_bytes_paths = n_bytes_paths;
+		indexEntry *idx = reinterpret_cast<indexEntry*>(&out[sizeof(fileHeader)]);
+		rectEntry *r = reinterpret_cast<rectEntry*>(idx + items.size());
+		char *str = reinterpret_cast<char*>(r + n_rects);
+		uint64_t i_rect = 0, offset_path = 0;
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			const item &it = items[i];
+			indexEntry &e = idx[i];
+			e.hash_path = it.hash;
+			e.offset_path = offset_path;
+			e.len_path = static_cast<uint32_t>(it.path.size());
+			e.img_w = it.size_img.width;
+			e.img_h = it.size_img.height;
+			e.unused = 0;
+			e.idx_rect_first = i_rect;
+			e.n_rects = it.n;
+			if (it.r_loaded)
+				std::memcpy(r + i_rect, it.r_loaded, it.n * sizeof(rectEntry));
+			else
+				for (size_t j = 0; j < it.n; j++)
+				{
+					const cv::Rect &rr = (*it.r_new)[j];
+					r[i_rect + j] = rectEntry{ rr.x, rr.y, rr.width, rr.height };
+				}
+			i_rect += it.n;
+			std::memcpy(str + offset_path, it.path.data(), it.path.size());
+			offset_path += it.path.size();
+		}
+
+		std::string fpath_tmp = fpath + ".tmp";
+		FILE *f = std::fopen(fpath_tmp.c_str(), "wb");
+		if (f == nullptr)
+		{
+			printf("ERROR: cannot open %s for writing\n", fpath_tmp.c_str());
+			throw std::runtime_error("");
+		}
+		size_t n_written = std::fwrite(&out[0], 1, out.size(), f);
+		bool ok = std::fclose(f) == 0 && n_written == out.size();
+		// rename replaces fpath in one step, so there is always a whole store at fpath
+		std::error_code ec;
+		if (ok) std::filesystem::rename(fpath_tmp, fpath, ec);
+		if (!ok || ec)
+		{
+			printf("ERROR: failed to write annotation store %s\n", fpath.c_str());
+			throw std::runtime_error("");
+		}
+	}
+
+	// FNV-1a hash of the image path
+	static uint64_t hash_str(const std::string &str)
+	{
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < str.size(); i++)
+		{
+			h ^= static_cast<unsigned char>(str[i]);
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+private:
+
+	struct fileHeader { char magic[4]; uint32_t version; uint64_t n_images, n_rects, n_bytes_paths; };
+	struct indexEntry { uint64_t hash_path, offset_path; uint32_t len_path; int32_t img_w, img_h; uint32_t unused; uint64_t idx_rect_first, n_rects; };
+	struct rectEntry { int32_t x, y, width, height; };
+	static_assert(sizeof(fileHeader) == 32 && sizeof(indexEntry) == 48 && sizeof(rectEntry) == 16, "unexpected padding");
+
+	struct imageRecord { cv::Size size_img; std::vector<cv::Rect> dr; };
+
+	std::vector<char> buf; // the loaded file
+	std::map<std::string, imageRecord> changes; // put since loading
+
+	const fileHeader* header() const { return reinterpret_cast<const fileHeader*>(&buf[0]); }
+	const indexEntry* index() const { return reinterpret_cast<const indexEntry*>(&buf[sizeof(fileHeader)]); }
+	const rectEntry* rects() const { return reinterpret_cast<const rectEntry*>(index() + header()->n_images); }
+	const char* paths() const { return reinterpret_cast<const char*>(rects() + header()->n_rects); }
+	std::string path_loaded(const indexEntry &e) const { return std::string(paths() + e.offset_path, e.len_path); }
+
+	// whether buf holds a well formed store: the sections given by the
+	// header add up to the size of the file (summed so that huge counts
+	// cannot overflow) and every index entry points within them, so that
+	// nothing read through the index can be out of bounds
+	bool valid() const
+	{
+		if (buf.size() < sizeof(fileHeader)) return false;
+		const fileHeader *h = header();
+		if (std::memcmp(h->magic, "ANNS", 4) != 0 || h->version != 1) return false;
+		uint64_t n_left = buf.size() - sizeof(fileHeader);
+		if (h->n_images > n_left / sizeof(indexEntry)) return false;
+		n_left -= h->n_images * sizeof(indexEntry);
+		if (h->n_rects > n_left / sizeof(rectEntry)) return false;
+		n_left -= h->n_rects * sizeof(rectEntry);
+		if (h->n_bytes_paths != n_left) return false;
+		for (uint64_t i = 0; i < h->n_images; i++)
+		{
+			const indexEntry &e = index()[i];
+			if (e.offset_path > h->n_bytes_paths || e.len_path > h->n_bytes_paths - e.offset_path ||
+				e.idx_rect_first > h->n_rects || e.n_rects > h->n_rects - e.idx_rect_first)
+				return false;
+		}
+		return true;
+	}
+
+	const indexEntry* find_loaded(const std::string &fpath_img) const
+	{
+		if (buf.empty()) return nullptr;
+		uint64_t h = hash_str(fpath_img);
+		const indexEntry *first = index(), *last = index() + header()->n_images;
+		const indexEntry *e = std::lower_bound(first, last, h, [](const indexEntry &a, uint64_t b) { return a.hash_path < b; });
+		for (; e != last && e->hash_path == h; ++e)
+			if (e->len_path == fpath_img.size() && std::memcmp(paths() + e->offset_path, fpath_img.data(), e->len_path) == 0)
+				return e;
+		return nullptr;
+	}
+};
+
+// settings of patchAugmenter
+struct augmentParams
+{
+	int n_variants; // per rectangle; 0 for no augmentation
+	double max_shift; // of the centre, as a fraction of the width and height
+	double max_scale; // the size is scaled by a factor in [1 - max_scale, 1 + max_scale]
+	bool flip; // mirror (left-right) about half of the variants
+	double max_brightness; // added to every pixel: uniform in [-max_brightness, max_brightness]
+
+	augmentParams() : n_variants(0), max_shift(0.1), max_scale(0.1), flip(true), max_brightness(20) {}
+};
+
+// makes shifted, scaled, mirrored and brightened variants of annotated
+// rectangles. Every variant is cropped from the full image, so that a shift
+// or an enlargement brings in the real surroundings of the object; the
+// border is replicated only where the crop leaves the image. The variants
+// are made in parallel on OpenCV's thread pool, each with its own random
+// generator seeded with its number, so the output does not depend on the
+// order in which they are made.
+class patchAugmenter
+{
+public:
+
+	patchAugmenter(const augmentParams &params_ = augmentParams(), uint64_t seed_ = 0)
+	{
+		params = params_;
+		seed = seed_;
+	}
+
+	int n_variants() const { return std::max(params.n_variants, 0); }
+
+	// the region of the image that every variant of rectangle r is cropped
+	// from, so that the variants made from just that region are the same
+	cv::Rect context(const cv::Rect &r) const
+	{
+		int mx = static_cast<int>(std::ceil((params.max_shift + params.max_scale) * r.width)) + 2;
+		int my = static_cast<int>(std::ceil((params.max_shift + params.max_scale) * r.height)) + 2;
+		return cv::Rect(r.x - mx, r.y - my, r.width + 2 * mx, r.height + 2 * my);
+	}
+
+	// the n_variants() variants of every rectangle of dr, rectangle after
+	// rectangle; id_first is the number of the first one
+	std::vector<cv::Mat> make_variants(const cv::Mat &img, const std::vector<cv::Rect> &dr, int id_first) const
+	{
+		int K = n_variants();
+		std::vector<cv::Mat> variants(dr.size() * K);
+		if (variants.empty()) return variants;
+		cv::parallel_for_(cv::Range(0, static_cast<int>(variants.size())), [&](const cv::Range &range) {
+			for (int i = range.start; i < range.end; i++)
+				variants[i] = make_variant(img, dr[i / K], static_cast<uint64_t>(id_first) + i);
+		});
+		return variants;
+	}
+
+	// the variant numbered id of rectangle r of img
+	cv::Mat make_variant(const cv::Mat &img, const cv::Rect &r, uint64_t id) const
+	{
+		cv::RNG rng((seed + id) * 0x9E3779B97F4A7C15ULL + 1);
+		double s = 1 + rng.uniform(-params.max_scale, params.max_scale);
+		int w = std::max(1, static_cast<int>(std::round(r.width * s)));
+		int h = std::max(1, static_cast<int>(std::round(r.height * s)));
+		double cx = r.x + r.width / 2.0 + rng.uniform(-params.max_shift, params.max_shift) * r.width;
+		double cy = r.y + r.height / 2.0 + rng.uniform(-params.max_shift, params.max_shift) * r.height;
+		cv::Rect rj(static_cast<int>(std::round(cx - w / 2.0)), static_cast<int>(std::round(cy - h / 2.0)), w, h);
+
+		cv::Mat variant;
+		cv::Rect r_in = rj & cv::Rect(0, 0, img.cols, img.rows);
+		if (r_in.area() <= 0)
+			variant = cv::Mat::zeros(rj.size(), img.type());
+		else
+			cv::copyMakeBorder(img(r_in), variant, r_in.y - rj.y, rj.y + rj.height - r_in.y - r_in.height,
+				r_in.x - rj.x, rj.x + rj.width - r_in.x - r_in.width, cv::BORDER_REPLICATE);
+		if (params.flip && rng.uniform(0, 2) == 1)
+			cv::flip(variant, variant, 1);
+		if (params.max_brightness > 0)
+			variant.convertTo(variant, -1, 1, rng.uniform(-params.max_brightness, params.max_brightness));
+		return variant;
+	}
+
+private:
+	augmentParams params;
+	uint64_t seed;
+};
+
+// draws negative (background) windows of size winsize from an image whose
+// objects are annotated: windows whose IoU with every annotated rectangle is
+// at most max_iou. Each window is tested in O(1) with an integral image of
+// the box coverage (the number of rectangles covering each pixel): the
+// coverage summed over a window W is the sum over the rectangles B of
+// |W & B|, and IoU(W, B) <= |W & B| / |W|, so a window whose sum is at most
+// max_iou * |W| passes against all the rectangles at once. The test is
+// conservative (a window touching several rectangles a little can be
+// rejected) and exact for max_iou = 0. RANDOM draws windows anywhere;
+// SLIDING takes them from a grid with the given stride (winsize / 2 if 0),
+// picking n_per_image of those that pass at random. sample() may be called
+// from several threads.
+class negativeSampler
+{
+public:
+
+	enum Mode { RANDOM, SLIDING };
+
+	negativeSampler(const cv::Size &winsize_ = cv::Size(64, 128), int n_per_image_ = 10,
+		double max_iou_ = 0.2, Mode mode_ = RANDOM, int stride_ = 0)
+	{
+		winsize = winsize_;
+		n_per_image = std::max(n_per_image_, 0);
+		max_iou = max_iou_;
+		mode = mode_;
+		stride = stride_;
+	}
+
+	int get_n_per_image() const { return n_per_image; }
+
+	// at most n_per_image windows of an image of size size_img annotated
+	// with dr; the same seed gives the same windows
+	std::vector<cv::Rect> sample(const cv::Size &size_img, const std::vector<cv::Rect> &dr, uint64_t seed) const
+	{
+		std::vector<cv::Rect> windows;
+		int range_x = size_img.width - winsize.width, range_y = size_img.height - winsize.height;
+		if (n_per_image == 0 || range_x < 0 || range_y < 0) return windows;
+
+		cv::Mat ii;
+		coverage_integral(size_img, dr, ii);
+		cv::RNG rng(seed * 0x9E3779B97F4A7C15ULL + 1);
+
+		if (mode == RANDOM)
+		{
+			// give up after a while on images mostly covered by objects
+			for (int t = 0; t < 50 * n_per_image && static_cast<int>(windows.size()) < n_per_image; t++)
+			{
+				cv::Rect w(rng.uniform(0, range_x + 1), rng.uniform(0, range_y + 1), winsize.width, winsize.height);
+				if (passes(ii, w)) windows.push_back(w);
+			}
+			return windows;
+		}
+
+		int sx = stride > 0 ? stride : std::max(winsize.width / 2, 1);
+		int sy = stride > 0 ? stride : std::max(winsize.height / 2, 1);
+		for (int y = 0; y <= range_y; y += sy)
+			for (int x = 0; x <= range_x; x += sx)
+			{
+				cv::Rect w(x, y, winsize.width, winsize.height);
+				if (passes(ii, w)) windows.push_back(w);
+			}
+		// a random subset of n_per_image (partial Fisher-Yates)
+		for (int i = 0; i < n_per_image && i < static_cast<int>(windows.size()); i++)
+			std::swap(windows[i], windows[i + rng.uniform(0, static_cast<int>(windows.size()) - i)]);
+		if (static_cast<int>(windows.size()) > n_per_image) windows.resize(n_per_image);
+		return windows;
+	}
+
+private:
+
+	cv::Size winsize;
+	int n_per_image;
+	double max_iou;
+	Mode mode;
+	int stride;
+
+	// ii: integral image ((h + 1) x (w + 1), CV_64F) of the number of
+	// rectangles of dr covering each pixel
+	static void coverage_integral(const cv::Size &size_img, const std::vector<cv::Rect> &dr, cv::Mat &ii)
+	{
+		// coverage as the 2D prefix sum of +1/-1 at the corners of the rectangles
+		cv::Mat corners = cv::Mat::zeros(size_img.height + 1, size_img.width + 1, CV_32S);
+		cv::Rect rect_img(0, 0, size_img.width, size_img.height);
+		for (size_t i = 0; i < dr.size(); i++)
+		{
+			cv::Rect r = dr[i] & rect_img;
+			if (r.area() <= 0) continue;
+			corners.at<int>(r.y, r.x) += 1;
+			corners.at<int>(r.y, r.x + r.width) -= 1;
+			corners.at<int>(r.y + r.height, r.x) -= 1;
+			corners.at<int>(r.y + r.height, r.x + r.width) += 1;
+		}
+		// by hand, as cv::integral does not take CV_32S: col holds the sums
+		// of the corners down each column and cov the coverage at (y, x)
+		ii = cv::Mat::zeros(size_img.height + 1, size_img.width + 1, CV_64F);
+		std::vector<int> col(size_img.width, 0);
+		for (int y = 0; y < size_img.height; y++)
+		{
+			const int *row_corners = corners.ptr<int>(y);
+			const double *row_above = ii.ptr<double>(y);
+			double *row_ii = ii.ptr<double>(y + 1);
+			int cov = 0;
+			double sum_row = 0;
+			for (int x = 0; x < size_img.width; x++)
+			{
+				col[x] += row_corners[x];
+				cov += col[x];
+				sum_row += cov;
+				row_ii[x + 1] = row_above[x + 1] + sum_row;
+			}
+		}
+	}
+
+	bool passes(const cv::Mat &ii, const cv::Rect &w) const
+	{
+		double sum = ii.at<double>(w.y + w.height, w.x + w.width) - ii.at<double>(w.y, w.x + w.width)
+			- ii.at<double>(w.y + w.height, w.x) + ii.at<double>(w.y, w.x);
+		return sum <= max_iou * w.area();
+	}
+};
+
+// tracks the rectangles of a frame into the next frame of a sequence by
+// matching each of them (normalized cross correlation on grayscale) only
+// within its own neighbourhood: the rectangle grown by margin times its
+// width and height on each side. The size of a rectangle is kept; the user
+// corrects those that grew or shrank. A rectangle whose best match scores
+// below min_score is left where it was, or dropped if keep_lost is false.
+class boxPropagator
+{
+public:
+
+	boxPropagator(double margin_ = 0.5, double min_score_ = 0.5, bool keep_lost_ = true)
+	{
+		margin = margin_;
+		min_score = min_score_;
+		keep_lost = keep_lost_;
+	}
+
+	std::vector<cv::Rect> propagate(const cv::Mat &img_prev, const std::vector<cv::Rect> &dr_prev, const cv::Mat &img_next) const
+	{
+		if (dr_prev.empty() || img_prev.empty() || img_next.empty()) return std::vector<cv::Rect>();
+		cv::Mat gray_prev = to_gray(img_prev), gray_next = to_gray(img_next);
+		cv::Rect bounds_prev(0, 0, gray_prev.cols, gray_prev.rows);
+		cv::Rect bounds_next(0, 0, gray_next.cols, gray_next.rows);
+
+		std::vector<cv::Rect> tracked(dr_prev.size());
+		std::vector<char> keep(dr_prev.size(), 0);
+		cv::parallel_for_(cv::Range(0, static_cast<int>(dr_prev.size())), [&](const cv::Range &range) {
+			cv::Mat score;
+			for (int i = range.start; i < range.end; i++)
+			{
+				cv::Rect r = dr_prev[i] & bounds_prev;
+				tracked[i] = dr_prev[i];
+				keep[i] = keep_lost;
+				if (r.width < 4 || r.height < 4) continue;
+				int dx = static_cast<int>(margin * r.width), dy = static_cast<int>(margin * r.height);
+				cv::Rect search = cv::Rect(r.x - dx, r.y - dy, r.width + 2 * dx, r.height + 2 * dy) & bounds_next;
+				if (search.width < r.width || search.height < r.height) continue;
+				cv::matchTemplate(gray_next(search), gray_prev(r), score, cv::TM_CCOEFF_NORMED);
+				double score_max;
+				cv::Point loc_max;
+				cv::minMaxLoc(score, nullptr, &score_max, nullptr, &loc_max);
+				if (score_max < min_score) continue;
+				tracked[i] = cv::Rect(search.tl() + loc_max, r.size());
+				keep[i] = 1;
+			}
+		});
+
+		std::vector<cv::Rect> dr_next;
+		for (size_t i = 0; i < tracked.size(); i++)
+			if (keep[i]) dr_next.push_back(tracked[i]);
+		return dr_next;
+	}
+
+	// dr_tracked followed by those of dr_proposed that overlap none of
+	// them by more than max_iou
+	static std::vector<cv::Rect> merge(const std::vector<cv::Rect> &dr_tracked, const std::vector<cv::Rect> &dr_proposed, double max_iou = 0.5)
+	{
+		std::vector<cv::Rect> dr = dr_tracked;
+		for (size_t i = 0; i < dr_proposed.size(); i++)
+		{
+			bool overlaps = false;
+			for (size_t j = 0; j < dr_tracked.size() && !overlaps; j++)
+			{
+				double inter = (dr_proposed[i] & dr_tracked[j]).area();
+				overlaps = inter > max_iou * (dr_proposed[i].area() + dr_tracked[j].area() - inter);
+			}
+			if (!overlaps) dr.push_back(dr_proposed[i]);
+		}
+		return dr;
+	}
+
+private:
+	double margin;
+	double min_score;
+	bool keep_lost;
+
+	static cv::Mat to_gray(const cv::Mat &img)
+	{
+		if (img.channels() == 1) return img;
+		cv::Mat gray;
+		cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+		return gray;
+	}
+};
+
+// lets several annotators (processes, possibly on different machines) work
+// on the same images, coordinating through a shared directory dir_leases
+// (local or NFS). An image is claimed by creating its lease file
+// <hash of key>.lease exclusively, which only one worker can do. A
+// background thread touches the leases held every ttl/3, and a lease left
+// untouched for ttl (its worker died) is taken over by the first worker to
+// rename it away, rename being atomic too, so the images of a dead worker
+// go back to the pool. A finished image gets a .done file instead. Workers
+// simply take the next image nobody holds, so faster ones take more; ttl
+// must be well above the clock skew between the machines.
+class workClaims
+{
+public:
+
+	workClaims(const std::string &dir_leases_, const std::string &worker_id_, double ttl_s_ = 60)
+	{
+		dir_leases = dir_leases_;
+		worker_id = worker_id_;
+		ttl = std::chrono::milliseconds(static_cast<long long>(ttl_s_ * 1000));
+		stopping = false;
+		std::filesystem::create_directories(dir_leases);
+		th_heartbeat = std::thread(&workClaims::heartbeat, this);
+	}
+
+	~workClaims()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		cv_stop.notify_all();
+		th_heartbeat.join();
+		release_all();
+	}
+
+	// try to claim the image named key (e.g. its path relative to the
+	// images directory, the same for all workers); may be called from
+	// several threads
+	bool claim(const std::string &key)
+	{
+		std::string fpath_lease = path_lease(key);
+		std::error_code ec;
+		if (std::filesystem::exists(path_done(key), ec)) return false;
+		if (!create_lease(fpath_lease))
+		{
+			std::string owner = read_owner(fpath_lease);
+			if (owner == worker_id) return hold(key); // ours, from before a restart
+			if (!expired(fpath_lease)) return false;
+			// expired: whoever renames it first takes it over. Another worker
+			// may have taken it over between the check and the rename, in
+			// which case what was renamed is its fresh lease: put it back.
+			std::string fpath_stale = fpath_lease + ".stale-" + worker_id;
+			std::filesystem::rename(fpath_lease, fpath_stale, ec);
+			if (ec) return false;
+			if (read_owner(fpath_stale) != owner || !expired(fpath_stale))
+			{
+				std::filesystem::create_hard_link(fpath_stale, fpath_lease, ec); // fails if there is a newer one
+				std::filesystem::remove(fpath_stale, ec);
+				return false;
+			}
+			std::filesystem::remove(fpath_stale, ec);
+			cout << "Taking over the expired lease of " << key << endl;
+			if (!create_lease(fpath_lease)) return false;
+		}
+		// it may have been finished between the check and the lease
+		if (std::filesystem::exists(path_done(key), ec))
+		{
+			std::filesystem::remove(fpath_lease, ec);
+			return false;
+		}
+		return hold(key);
+	}
+
+	// the image named key is done; call once its outputs are written
+	void finish(const std::string &key)
+	{
+		FILE *f = std::fopen(path_done(key).c_str(), "wb");
+		if (f)
+		{
+			std::fprintf(f, "%s\n%s\n", worker_id.c_str(), key.c_str());
+			std::fclose(f);
+		}
+		release(key);
+	}
+
+	// whether another worker is on the image named key, i.e. holds a lease
+	// on it that has not expired; a .done image is not held
+	bool held_elsewhere(const std::string &key)
+	{
+		std::string fpath_lease = path_lease(key);
+		std::string owner = read_owner(fpath_lease);
+		return !owner.empty() && owner != worker_id && !expired(fpath_lease);
+	}
+
+	bool is_done(const std::string &key) const
+	{
+		std::error_code ec;
+		return std::filesystem::exists(path_done(key), ec);
+	}
+
+	// give back the images claimed but not finished
+	void release_all()
+	{
+		std::set<std::string> keys;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			keys = held;
+		}
+		for (std::set<std::string>::iterator it = keys.begin(); it != keys.end(); ++it)
+			release(*it);
+	}
+
+	const std::string& get_worker_id() const { return worker_id; }
+
+private:
+	std::string dir_leases;
+	std::string worker_id;
+	std::chrono::milliseconds ttl;
+	std::set<std::string> held; // keys of the leases held
+	std::mutex mtx;
+	std::condition_variable cv_stop;
+	bool stopping;
+	std::thread th_heartbeat;
+
+	std::string path_lease(const std::string &key) const { return fmt::sprintf("%s%016llx.lease", dir_leases, annotationStore::hash_str(key)); }
+	std::string path_done(const std::string &key) const { return fmt::sprintf("%s%016llx.done", dir_leases, annotationStore::hash_str(key)); }
+
+	// create fpath_lease unless it exists, atomically (O_EXCL)
+	bool create_lease(const std::string &fpath_lease)
+	{
+		FILE *f = std::fopen(fpath_lease.c_str(), "wx");
+		if (f == nullptr) return false;
+		std::fprintf(f, "%s\n", worker_id.c_str());
+		std::fclose(f);
+		return true;
+	}
+
+	bool expired(const std::string &fpath_lease) const
+	{
+		std::error_code ec;
+		std::filesystem::file_time_type t = std::filesystem::last_write_time(fpath_lease, ec);
+		return !ec && std::filesystem::file_time_type::clock::now() - t >= ttl;
+	}
+
+	// empty if there is no such lease
+	std::string read_owner(const std::string &fpath_lease)
+	{
+		std::ifstream fs(fpath_lease);
+		std::string owner;
+		std::getline(fs, owner);
+		return owner;
+	}
+
+	// false if another thread of this worker holds it already
+	bool hold(const std::string &key)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		return held.insert(key).second;
+	}
+
+	// only a lease held is removed, never another worker's (one that took
+	// it over after it expired)
+	void release(const std::string &key)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (held.erase(key) == 0) return;
+		std::error_code ec;
+		if (read_owner(path_lease(key)) == worker_id)
+			std::filesystem::remove(path_lease(key), ec);
+	}
+
+	void heartbeat()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		while (!cv_stop.wait_for(lock, ttl / 3, [this] { return stopping; }))
+		{
+			std::filesystem::file_time_type now = std::filesystem::file_time_type::clock::now();
+			for (std::set<std::string>::iterator it = held.begin(); it != held.end();)
+			{
+				// touch only our own lease; if another worker has it now, ours
+				// expired (e.g. this process was suspended for longer than ttl)
+				std::error_code ec;
+				bool ours = read_owner(path_lease(*it)) == worker_id;
+				if (ours) std::filesystem::last_write_time(path_lease(*it), now, ec);
+				if (ours && !ec)
+				{
+					++it;
+					continue;
+				}
+				cout << "Lost the lease of " << *it << "; another worker may annotate it too" << endl;
+				it = held.erase(it);
+			}
+		}
+	}
+};
+
+// annotate object detection dataset
+class annotate_obj_det_dataset
+{
+private:
+	cv::Size winsize; // detection window size
+	std::string dir_images, dir_output;
+	getRect_user &getRect_obj;
+	int n_prefetch; // number of images decoded ahead; 0 to decode inline
+	int n_threads_prefetch;
+	int n_threads_write; // threads encoding and writing patches
+	int capacity_write; // max patches queued before annotate() waits for the writers
+	std::string fpath_record_dr, fpath_record_events; // empty if not recording
+	std::string fpath_store; // annotation store; empty for none
+	std::string fpath_journal; // session journal; empty for none
+	std::string dir_leases; // shared by the workers; empty when annotating alone
+	std::string worker_id;
+	double ttl_lease;
+	std::unique_ptr<workClaims> claims; // of the session, in worker mode
+	std::string fpath_manifest; // cached list of images; empty for none
+	bool recursive_images; // also annotate images in subdirectories of dir_images
+	int reduce_preview; // images are shown at 1/reduce_preview of their resolution
+	int n_threads_full; // threads decoding full resolution images for the patches
+	bool resize_to_winsize; // patches are resized to winsize before being written
+	bool hashed_names; // PNGs named by the hash of their pixels, see patchSink_hashed
+	std::string fpath_tensor; // all patches in one .npy tensor instead of PNGs; empty for PNGs
+	std::string prefix_shards; // patches in shard files instead of PNGs; empty for PNGs
+	size_t max_bytes_shard;
+	patchAugmenter augmenter; // variants written after the patches of each image
+	negativeSampler sampler;
+	preAnnotator *pre_annotator; // not owned; nullptr for none
+	std::unique_ptr<boxPropagator> propagator; // nullptr unless frames are a sequence
+	std::string dir_negatives; // where negatives are written; empty for none
+	int n_threads_neg; // threads sampling and extracting negatives
+	bool trace_enabled;
+	std::string fpath_trace; // CSV of the stage timings; empty for none
+	std::unique_ptr<latencyTrace> trace; // of the last session; nullptr if not enabled
+
+public:
+
+	// make sure that "dir_images_" has "/" at the end
+	annotate_obj_det_dataset(std::string dir_images_, std::string dir_output_, 
+		const cv::Size &winsize_, getRect_user &getRect_obj_)
+		: getRect_obj(getRect_obj_)
+	{
+		dir_images = dir_images_;
+		dir_output = dir_output_;
+		winsize = winsize_;		
+		n_prefetch = 4;
+		n_threads_prefetch = 2;
+		n_threads_write = 4;
+		capacity_write = 1024;
+		recursive_images = false;
+		reduce_preview = 1;
+		n_threads_full = 2;
+		resize_to_winsize = false;
+		hashed_names = false;
+		max_bytes_shard = size_t(256) << 20;
+		n_threads_neg = 2;
+		pre_annotator = nullptr;
+		trace_enabled = false;
+		ttl_lease = 60;
+
+		if (dir_images[dir_images.size() - 1] != '/')
+		{
+			printf("ERROR: dir_images_ must end with '/'\n");
+			throw std::runtime_error("");
+		}
+
+		if (dir_output[dir_output.size() - 1] != '/')
+		{
+			printf("ERROR: dir_output_ must end with '/'\n");
+			throw std::runtime_error("");
+		}
+
+	}
+
+	// set how many of the upcoming images are decoded in the background
+	// while the user is annotating the current one. Setting n_prefetch_ to 0
+	// decodes each image on the UI thread right before it is shown.
+	void set_prefetch(int n_prefetch_, int n_threads_ = 2)
+	{
+		n_prefetch = n_prefetch_;
+		n_threads_prefetch = n_threads_;
+	}
+
+	// set the number of threads that write patches in the background and
+	// how many patches may be waiting to be written before annotate() blocks
+	void set_writer(int n_threads_, int capacity_ = 1024)
+	{
+		n_threads_write = n_threads_;
+		capacity_write = capacity_;
+	}
+
+	// save the rectangles and the mouse events of every image of the session
+	// (in the format of getRect_replay) so that the session can later be
+	// replayed without a display. Either path can be empty to not save it.
+	void set_record_session(std::string fpath_dr_, std::string fpath_events_ = "")
+	{
+		fpath_record_dr = fpath_dr_;
+		fpath_record_events = fpath_events_;
+	}
+
+	// cache the list of images of dir_images in a manifest at fpath_manifest_
+	// so that later runs only rescan the directories that changed, and
+	// whether to include the images in all subdirectories of dir_images
+	// (subdirectories that are symbolic links are not followed). Deep Zoom
+	// images (.dzi) are listed too and are read region by region; a TIFF is
+	// decoded in full like any other image, so a very large one (e.g. a
+	// pyramidal slide scan) must first be converted to Deep Zoom, e.g. with
+	// "vips dzsave scan.tif scan".
+	void set_manifest(std::string fpath_manifest_, bool recursive_ = false)
+	{
+		fpath_manifest = fpath_manifest_;
+		recursive_images = recursive_;
+	}
+
+	// keep the rectangles of every annotated image in an annotationStore at
+	// fpath_store_ (added to it if it already exists), so that the patches
+	// can later be regenerated with extract_from_store
+	void set_annotation_store(std::string fpath_store_)
+	{
+		fpath_store = fpath_store_;
+	}
+
+	// show each image decoded at 1/reduce_ of its resolution (2, 4 or 8; 1 to
+	// show it in full). For JPEG the decoder does the reduction in the DCT
+	// domain, which is several times faster than a full decode. The full
+	// resolution image is then decoded only to extract the patches, on
+	// n_threads_ background threads, with the rectangles scaled up to it.
+	// Sessions recorded with set_record_session are in preview coordinates.
+	// Deep Zoom images are not reduced: they are read region by region anyway.
+	void set_preview_reduce(int reduce_, int n_threads_ = 2)
+	{
+		imgPrefetcher::flags_reduced(cv::IMREAD_COLOR, reduce_); // validates reduce_
+		reduce_preview = reduce_;
+		n_threads_full = n_threads_;
+	}
+
+	// resize every patch to winsize before writing it (all the patches of an
+	// image together, on several threads)
+	void set_resize_to_winsize(bool resize_to_winsize_)
+	{
+		resize_to_winsize = resize_to_winsize_;
+	}
+
+	// name the PNGs written to dir_output (and dir_negatives) by a hash of
+	// their pixels instead of by their number, and skip those that already
+	// exist (see patchSink_hashed), so that exports are idempotent and
+	// incremental. Not used with tensor or shard output.
+	void set_hashed_names(bool hashed_names_)
+	{
+		hashed_names = hashed_names_;
+	}
+
+	// instead of a PNG per patch in dir_output, write all the patches,
+	// resized to winsize, into a single memory mappable tensor in .npy format
+	// (see patchSink_npy); the patch numbered id is at index id - 1.
+	// An empty path goes back to PNGs.
+	void set_tensor_output(std::string fpath_tensor_)
+	{
+		fpath_tensor = fpath_tensor_;
+	}
+
+	// instead of a PNG file per patch in dir_output, append the PNGs to shard
+	// files prefix_-00000.rec, ... of at most max_bytes_shard_ bytes, with an
+	// index prefix_.idx (see patchSink_shards; read with patchShardReader).
+	// An empty prefix goes back to PNG files.
+	void set_shard_output(std::string prefix_, size_t max_bytes_shard_ = size_t(256) << 20)
+	{
+		prefix_shards = prefix_;
+		max_bytes_shard = max_bytes_shard_;
+	}
+
+	// the sink for the patches as configured
+	std::unique_ptr<patchSink> make_sink()
+	{
+		if (!fpath_tensor.empty())
+			return std::unique_ptr<patchSink>(new patchSink_npy(fpath_tensor, winsize, 3, n_threads_write));
+		if (!prefix_shards.empty())
+			return std::unique_ptr<patchSink>(new patchSink_shards(prefix_shards, max_bytes_shard, ".png",
+				n_threads_write, capacity_write, resize_to_winsize ? winsize : cv::Size()));
+		return make_sink_png(dir_output, resize_to_winsize ? winsize : cv::Size());
+	}
+
+	// PNG files in dir_, numbered or named by their hash
+	std::unique_ptr<patchSink> make_sink_png(const std::string &dir_, const cv::Size &size_out_ = cv::Size())
+	{
+		if (hashed_names)
+			return std::unique_ptr<patchSink>(new patchSink_hashed(dir_, n_threads_write, capacity_write, size_out_));
+		return std::unique_ptr<patchSink>(new patchSink_png(dir_, n_threads_write, capacity_write, size_out_));
+	}
+
+	// rectangles annotated on an image decoded at 1/reduce of its resolution,
+	// in full resolution coordinates and clipped to an image of size size_full
+	static std::vector<cv::Rect> scale_rects(const std::vector<cv::Rect> &dr, int reduce, const cv::Size &size_full)
+	{
+		std::vector<cv::Rect> dr_full(dr.size());
+		cv::Rect rect_img(0, 0, size_full.width, size_full.height);
+		for (size_t i = 0; i < dr.size(); i++)
+			dr_full[i] = cv::Rect(dr[i].x * reduce, dr[i].y * reduce, dr[i].width * reduce, dr[i].height * reduce) & rect_img;
+		return dr_full;
+	}
+
+	// also write params_.n_variants augmented variants (see patchAugmenter) of
+	// every annotated rectangle. They are numbered after the patches of their
+	// image: with n rectangles and K variants, an image whose first patch is
+	// number id gets patches id .. id + n - 1, then the K variants of its
+	// first rectangle, then those of the second, and so on.
+	void set_augmentation(const augmentParams &params_, uint64_t seed_ = 0)
+	{
+		augmenter = patchAugmenter(params_, seed_);
+	}
+
+	// start every image from the rectangles proposed by pre_annotator_ (e.g.
+	// preAnnotator_hog or preAnnotator_dnn; not owned, nullptr for none), so
+	// that the user only corrects them. This needs a getRect_user that can
+	// edit rectangles, i.e. manipRect. The proposals are computed by the
+	// prefetching threads together with the decoding (see set_prefetch), so
+	// with a pre_annotator_ at least one image is always decoded ahead. A
+	// proposal that fails leaves its image with none.
+	void set_pre_annotator(preAnnotator *pre_annotator_)
+	{
+		pre_annotator = pre_annotator_;
+	}
+
+	// the images are frames of sequences (one sequence per directory, e.g.
+	// set01/V000/ with set_manifest's recursive_), so start every frame from
+	// the rectangles confirmed on the previous frame of its sequence, tracked
+	// by a boxPropagator. Tracking starts as soon as the user confirms a
+	// frame and runs while that frame's patches are queued. Tracked rectangles
+	// come before the proposals of a pre-annotator that they overlap.
+	void set_propagation(bool propagate_, double margin_ = 0.5, double min_score_ = 0.5, bool keep_lost_ = true)
+	{
+		propagator.reset(propagate_ ? new boxPropagator(margin_, min_score_, keep_lost_) : nullptr);
+	}
+
+	// keep a journal of the session at fpath_journal_ (see annotationJournal)
+	// so that nothing but the last fraction of a second is lost if the
+	// process dies: when annotate() is run again with the same journal, the
+	// images finished are skipped (their rectangles still count for the
+	// patch numbers, the store and the recordings) and the image left
+	// unfinished comes back as it was, undo history included. The patches
+	// of a finished image are extracted again, in the background, unless
+	// the journal recorded that they had all been written.
+	void set_journal(std::string fpath_journal_)
+	{
+		fpath_journal = fpath_journal_;
+	}
+
+	// annotate as one of several workers sharing dir_images and dir_output
+	// (see workClaims): each image is annotated by whichever worker claims
+	// it first through dir_leases_ (shared, ending with '/'). So that
+	// workers never collide, every output of a worker goes to a path of its
+	// own (see worker_path): patches to dir_output/<worker_id>/, the store to
+	// <store>.<worker_id>.<ext>, and so on. A worker restarted with the same
+	// worker_id_ takes its leases back and, with a journal, carries on where
+	// it was; an empty worker_id_ makes up a unique one. Once all workers are
+	// done, merge_workers builds the combined index.
+	void set_worker(std::string dir_leases_, std::string worker_id_ = "", double ttl_lease_s_ = 60)
+	{
+		if (!dir_leases_.empty() && dir_leases_[dir_leases_.size() - 1] != '/')
+		{
+			printf("ERROR: dir_leases_ must end with '/'\n");
+			throw std::runtime_error("");
+		}
+		dir_leases = dir_leases_;
+		worker_id = worker_id_;
+		if (worker_id.empty())
+			worker_id = fmt::sprintf("%016llx", static_cast<unsigned long long>(std::chrono::system_clock::now().time_since_epoch().count()) ^
+				static_cast<unsigned long long>(std::hash<std::thread::id>()(std::this_thread::get_id())));
+		ttl_lease = ttl_lease_s_;
+	}
+
+	// where the output path (a directory if it ends with '/') goes for worker
+	// worker_id_: "dir/" -> "dir/<worker_id_>/", "dir/name.ext" -> "dir/name.<worker_id_>.ext"
+	static std::string worker_path(const std::string &path, const std::string &worker_id_)
+	{
+		if (path.empty()) return path;
+		if (path[path.size() - 1] == '/') return path + worker_id_ + "/";
+		size_t pos_name = path.find_last_of('/');
+		pos_name = pos_name == std::string::npos ? 0 : pos_name + 1;
+		size_t pos_ext = path.find_last_of('.');
+		if (pos_ext == std::string::npos || pos_ext <= pos_name) return path + "." + worker_id_;
+		return path.substr(0, pos_ext) + "." + worker_id_ + path.substr(pos_ext);
+	}
+
+	// once all workers are done: number the PNG patches of all the workers in
+	// dir_output_ consecutively, by worker name and then by their own number,
+	// and list them in index.csv in dir_output_ as "id,path" (relative to
+	// dir_output_). With fpath_store_, also merge the annotation stores of
+	// the workers into it.
+	static void merge_workers(const std::string &dir_output_, const std::string &fpath_store_ = "")
+	{
+		std::vector<std::string> workers;
+		for (std::filesystem::directory_iterator it(dir_output_), end; it != end; ++it)
+			if (it->is_directory()) workers.push_back(it->path().filename().string());
+		std::sort(workers.begin(), workers.end());
+
+		std::string fpath_index = dir_output_ + "index.csv";
+		std::ofstream fs(fpath_index);
+		if (!fs.is_open())
+		{
+			printf("ERROR: could not create %s\n", fpath_index.c_str());
+			throw std::runtime_error("");
+		}
+		fs << "id,path\n";
+		int id = 0;
+		annotationStore store;
+		if (!fpath_store_.empty() && annotationStore::file_exists(fpath_store_))
+			store.load(fpath_store_);
+		for (size_t w = 0; w < workers.size(); w++)
+		{
+			std::vector<std::string> names;
+			for (std::filesystem::directory_iterator it(dir_output_ + workers[w]), end; it != end; ++it)
+				if (it->is_regular_file() && it->path().extension() == ".png")
+					names.push_back(it->path().filename().string());
+			std::sort(names.begin(), names.end());
+			for (size_t k = 0; k < names.size(); k++)
+				fs << ++id << ',' << workers[w] << '/' << names[k] << '\n';
+
+			std::string fpath_store_worker = worker_path(fpath_store_, workers[w]);
+			if (fpath_store_.empty() || !annotationStore::file_exists(fpath_store_worker)) continue;
+			annotationStore store_worker(fpath_store_worker);
+			std::vector<std::string> fpaths_img = store_worker.image_paths();
+			for (size_t k = 0; k < fpaths_img.size(); k++)
+			{
+				std::vector<cv::Rect> dr;
+				cv::Size size_img;
+				store_worker.get(fpaths_img[k], dr, &size_img);
+				store.put(fpaths_img[k], size_img, dr);
+			}
+		}
+		if (!fpath_store_.empty()) store.save(fpath_store_);
+		cout << "Merged " << workers.size() << " workers: " << id << " patches" << endl;
+	}
+
+	// time every stage of the session and print the percentiles of each at
+	// the end (and write all timings to the CSV fpath_trace_ unless it is
+	// empty; see latencyTrace). Stages, by image index unless noted:
+	//     decode, propose: decoding and pre-annotating (prefetch threads)
+	//     wait_image: UI thread blocked waiting for the next image
+	//     get_dr: whole interaction of the user with an image
+	//     first_rect: from showing an image to its first new rectangle
+	//     render: from a mouse event to its rendering
+	//     propagate: tracking the boxes into the next frame
+	//     full_decode: decoding at full resolution (with a reduced preview)
+	//     extract: cropping, augmenting and queueing the patches
+	//     negatives: sampling and queueing the negatives
+	//     write: encoding and writing a patch, by patch number
+	void set_trace(bool trace_enabled_, std::string fpath_trace_ = "")
+	{
+		trace_enabled = trace_enabled_;
+		fpath_trace = fpath_trace_;
+	}
+
+	// also sample negatives from every annotated image (windows of size
+	// winsize overlapping no annotated rectangle by more than max_iou_; see
+	// negativeSampler) and write them as PNGs named "%05d.png" in
+	// dir_negatives_, which must end with '/'. Each image takes n_per_image_
+	// numbers, so numbers are skipped when fewer windows pass. The sampling
+	// and extraction run on n_threads_ background threads. Deep Zoom images
+	// give no negatives (and take no numbers).
+	void set_negatives(std::string dir_negatives_, int n_per_image_ = 10, double max_iou_ = 0.2,
+		negativeSampler::Mode mode_ = negativeSampler::RANDOM, int n_threads_ = 2)
+	{
+		if (!dir_negatives_.empty() && dir_negatives_[dir_negatives_.size() - 1] != '/')
+		{
+			printf("ERROR: dir_negatives_ must end with '/'\n");
+			throw std::runtime_error("");
+		}
+		dir_negatives = dir_negatives_;
+		sampler = negativeSampler(winsize, n_per_image_, max_iou_, mode_);
+		n_threads_neg = n_threads_;
+	}
+
+	// sample the negatives of an image annotated with dr and put them into
+	// sink, numbered from id_first
+	void put_negatives(patchSink &sink, const cv::Mat &img, const std::vector<cv::Rect> &dr, int id_first, uint64_t seed)
+	{
+		latencyTrace::scope t(trace.get(), "negatives", static_cast<long long>(seed));
+		std::vector<cv::Rect> windows = sampler.sample(img.size(), dr, seed);
+		sink.put_batch(id_first, extract_patches(img, windows));
+	}
+
+	// how many patch numbers an image with n_rects rectangles takes
+	int n_ids(size_t n_rects) const
+	{
+		return static_cast<int>(n_rects) * (1 + augmenter.n_variants());
+	}
+
+	// put the patches of dr and their variants into sink, numbered from id_first
+	void put_patches(patchSink &sink, const cv::Mat &img, const std::vector<cv::Rect> &dr, int id_first)
+	{
+		sink.put_batch(id_first, extract_patches(img, dr));
+		if (augmenter.n_variants() > 0)
+		{
+			int id_variants = id_first + static_cast<int>(dr.size());
+			sink.put_batch(id_variants, augmenter.make_variants(img, dr, id_variants));
+		}
+	}
+
+	// same for a tiled image, reading only the rectangles (clipped to the
+	// image; a rectangle outside it gives an empty patch) and the regions
+	// around them that their variants come from
+	void put_patches(patchSink &sink, tileReader &reader, const std::vector<cv::Rect> &dr, int id_first)
+	{
+		cv::Rect rect_img(cv::Point(0, 0), reader.size());
+		std::vector<cv::Mat> patches(dr.size());
+		for (size_t j = 0; j < dr.size(); j++)
+			if ((dr[j] & rect_img).area() > 0)
+				patches[j] = reader.read(dr[j] & rect_img);
+		sink.put_batch(id_first, patches);
+		int K = augmenter.n_variants();
+		for (size_t j = 0; K > 0 && j < dr.size(); j++)
+		{
+			cv::Rect region = augmenter.context(dr[j]) & rect_img;
+			if (region.area() <= 0) continue;
+			int id_variants = id_first + static_cast<int>(dr.size() + j * K);
+			sink.put_batch(id_variants, augmenter.make_variants(reader.read(region),
+				std::vector<cv::Rect>(1, dr[j] - region.tl()), id_variants));
+		}
+	}
+
+	// extract patches from a given image and vector of rectangles
+	std::vector<cv::Mat> extract_patches(const cv::Mat &img, const std::vector<cv::Rect> &recs)
+	{
+		std::vector<cv::Mat> patches(recs.size());
+		for (int i = 0; i < recs.size(); i++)
+			patches[i] = img(recs[i]);
+		return patches;
+	}
+
+	// the image at index idx of fpaths with its proposals, from prefetcher
+	// if there is one and otherwise decoded (and pre-annotated) here
+	prefetchedImg fetch_image(imgPrefetcher *prefetcher, const std::vector<std::string> &fpaths, size_t idx)
+	{
+		latencyTrace::scope t(trace.get(), "wait_image", static_cast<long long>(idx));
+		if (prefetcher) return prefetcher->get(idx);
+		prefetchedImg item;
+		item.fpath = fpaths[idx];
+		item.reduce = reduce_preview;
+		item.skipped = claims && !claims->claim(claim_key(fpaths[idx]));
+		if (item.skipped || item.open_tiled()) return item;
+		{
+			latencyTrace::scope t_decode(trace.get(), "decode", static_cast<long long>(idx));
+			item.img = cv::imread(fpaths[idx], imgPrefetcher::flags_reduced(cv::IMREAD_COLOR, reduce_preview));
+		}
+		if (pre_annotator && !item.img.empty())
+		{
+			latencyTrace::scope t_propose(trace.get(), "propose", static_cast<long long>(idx));
+			try { item.dr_proposed = pre_annotator->propose(item.img); }
+			catch (const cv::Exception &e) { cout << "Pre-annotation failed for " << fpaths[idx] << ": " << e.what() << endl; }
+		}
+		return item;
+	}
+
+	// the name of an image for workClaims: its path within dir_images, the
+	// same for all workers wherever they mount it
+	std::string claim_key(const std::string &fpath) const
+	{
+		return fpath.compare(0, dir_images.size(), dir_images) == 0 ? fpath.substr(dir_images.size()) : fpath;
+	}
+
+	void annotate()
+	{
+		if (dir_leases.empty())
+		{
+			annotate_session();
+			return;
+		}
+
+		// the outputs of this worker go to paths of its own for the session
+		std::vector<std::string*> paths = { &dir_output, &fpath_tensor, &prefix_shards, &dir_negatives, &fpath_store,
+			&fpath_record_dr, &fpath_record_events, &fpath_journal, &fpath_trace };
+		std::vector<std::string> paths_shared(paths.size());
+		for (size_t k = 0; k < paths.size(); k++)
+		{
+			paths_shared[k] = *paths[k];
+			*paths[k] = worker_path(*paths[k], worker_id);
+			if (!paths[k]->empty() && (*paths[k])[paths[k]->size() - 1] == '/')
+				std::filesystem::create_directories(*paths[k]);
+		}
+		cout << "Annotating as worker " << worker_id << endl;
+		claims.reset(new workClaims(dir_leases, worker_id, ttl_lease));
+		try { annotate_session(); }
+		catch (...)
+		{
+			claims.reset();
+			for (size_t k = 0; k < paths.size(); k++) *paths[k] = paths_shared[k];
+			throw;
+		}
+		claims.reset();
+		for (size_t k = 0; k < paths.size(); k++) *paths[k] = paths_shared[k];
+	}
+
+	// annotate() for this process alone, or as a worker once the paths are set
+	void annotate_session()
+	{
+		// read in image full paths
+		imageManifest manifest(dir_images, recursive_images);
+		manifest.build(fpath_manifest);
+		std::vector<std::string> fpaths = manifest.get_fpaths();
+		cout << "Number of images to annotate = " << fpaths.size() << endl;
+
+		std::vector<cv::Rect> dr;
+		int counter = 0;
+
+		trace.reset(trace_enabled ? new latencyTrace : nullptr);
+		latencyTrace *trace_ptr = trace.get();
+
+		// decode the upcoming images while the user is busy annotating. The
+		// proposals of a pre_annotator are always computed there, never on
+		// the UI thread.
+		int n_ahead = n_prefetch, n_threads_ahead = n_threads_prefetch;
+		if (pre_annotator)
+		{
+			n_ahead = std::max(n_ahead, 1);
+			n_threads_ahead = std::max(n_threads_ahead, 1);
+		}
+		std::unique_ptr<imgPrefetcher> prefetcher;
+		if (n_ahead > 0)
+		{
+			// with workers, images are claimed just ahead of being decoded
+			std::function<bool(size_t)> claim;
+			if (claims)
+				claim = [this, &fpaths](size_t idx) { return claims->claim(claim_key(fpaths[idx])); };
+			prefetcher.reset(new imgPrefetcher(fpaths, n_ahead, n_threads_ahead, cv::IMREAD_COLOR, reduce_preview,
+				pre_annotator, trace_ptr, claim));
+		}
+
+		// patches are encoded and written in the background
+		std::unique_ptr<patchSink> sink = make_sink();
+		sink->set_trace(trace_ptr);
+
+		annotationStore store;
+		std::mutex mtx_store; // for the full resolution decodes putting into store
+		if (!fpath_store.empty() && annotationStore::file_exists(fpath_store))
+			store.load(fpath_store);
+
+		// negatives are sampled in the background and go to their own sink
+		std::unique_ptr<patchSink> sink_neg;
+		std::unique_ptr<workerPool> pool_neg;
+		int counter_neg = 0;
+		if (!dir_negatives.empty())
+		{
+			sink_neg = make_sink_png(dir_negatives);
+			sink_neg->set_trace(trace_ptr);
+			pool_neg.reset(new workerPool(n_threads_neg, 2 * n_threads_neg));
+		}
+
+		// with a reduced preview, full resolution decodes and patch extraction
+		// run here; few are queued as each holds a full resolution image
+		std::unique_ptr<workerPool> pool_full;
+		if (reduce_preview > 1)
+			pool_full.reset(new workerPool(n_threads_full, 2 * n_threads_full));
+
+		// recorded by position in fpaths, the images skipped left empty
+		std::vector<std::vector<cv::Rect>> dr_all(fpath_record_dr.empty() ? 0 : fpaths.size());
+		std::vector<std::vector<mouseEvent>> events_all(fpath_record_events.empty() ? 0 : fpaths.size());
+		getRect_obj.set_record_events(!fpath_record_events.empty());
+
+		std::unique_ptr<annotationJournal> journal;
+		if (!fpath_journal.empty())
+		{
+			journal.reset(new annotationJournal(fpath_journal));
+			if (journal->n_finished() > 0)
+				cout << "Resuming: " << journal->n_finished() << " images already finished" << endl;
+		}
+		getRect_obj.set_journal(journal.get());
 
-				switch (thisObj->mode_click)
-				{
-				case manipRect::ModeClicks::TL_BR:
-				{
-					rect_cur = cv::Rect(thisObj->point1, thisObj->point2);
+		// with a journal or other workers, the images whose patches are not
+		// extracted on pool_full are recorded as done here, once their
+		// patches are written
+		std::unique_ptr<workerPool> pool_done;
+		if (journal || claims)
+			pool_done.reset(new workerPool(1, 256));
 
-					// if not the special user specified aspect ratio of 0
-					// then I will adjust the rect_cur so that it will
-					// satisfy the abs(aspect_ratio)
-					if (thisObj->aspect_ratio != 0)
-					{
-						// estimate center of rectangle
-						int cx = thisObj->point1.x + rect_cur.width / 2;
-						int cy = thisObj->point1.y + rect_cur.height / 2;
-						int w, h;
+		// with propagation the next frame is fetched as soon as the current
+		// one is confirmed, and tracked into on another thread
+		prefetchedImg item_next;
+		bool have_next = false;
+		std::future<std::vector<cv::Rect>> dr_tracked;
 
-						// keep height and change width
-						if (thisObj->aspect_ratio > 0)
-						{
-							h = rect_cur.height;
-							w = static_cast<float>(h) * std::abs(thisObj->aspect_ratio);
-						}
-						// keep width, change height
-						else
+		// go through each image and annotate with bounding boxes. With other
+		// workers, the images held by them when their turn came are revisited
+		// after each pass, until every one is done or held by a live lease;
+		// those whose lease expired meanwhile are claimed then. Revisits are
+		// decoded here and not propagated into.
+		std::vector<size_t> order(fpaths.size()), skipped;
+		for (size_t i = 0; i < order.size(); i++) order[i] = i;
+		for (bool revisit = false; !order.empty(); revisit = true)
+		{
+			for (size_t k = 0; k < order.size(); k++)
+			{
+				size_t i = order[k];
+				if (journal && journal->is_finished(fpaths[i]))
+				{
+					std::vector<cv::Rect> dr_done = journal->get_dr_finished(fpaths[i]);
+					if (!fpath_record_dr.empty()) dr_all[i] = dr_done;
+					int id_first = counter + 1, id_first_neg = counter_neg + 1;
+					// tiled images are neither reduced nor given negatives
+					bool tiled = tileReader_dzi::is_dzi(fpaths[i]);
+					bool reduced = pool_full && !tiled;
+					counter += n_ids(dr_done.size());
+					if (sink_neg && !tiled) counter_neg += sampler.get_n_per_image();
+					cv::Size size_full = journal->get_size_full(fpaths[i]);
+					if (size_full.area() <= 0)
+					{
+						// the session ended before all its patches were written:
+						// make them again
+						std::string fpath = fpaths[i];
+						patchSink *sink_ptr = sink.get(), *sink_neg_ptr = tiled ? nullptr : sink_neg.get();
+						annotationJournal *journal_ptr = journal.get();
+						workerPool *pool_redo = pool_full ? pool_full.get() : pool_done.get();
+						pool_redo->submit([this, fpath, dr_done, id_first, sink_ptr, sink_neg_ptr, id_first_neg, i, journal_ptr, &store, &mtx_store]() {
+							process_image_full(fpath, dr_done, id_first, *sink_ptr, store, mtx_store, sink_neg_ptr, id_first_neg, i, journal_ptr); });
+					}
+					else
+					{
+						if (!fpath_store.empty())
 						{
-							w = rect_cur.width;
-							h = static_cast<float>(w) / std::abs(thisObj->aspect_ratio);
+							std::lock_guard<std::mutex> lock(mtx_store);
+							store.put(fpaths[i], size_full, scale_rects(dr_done, reduced ? reduce_preview : 1, size_full));
 						}
-						rect_cur = cv::Rect(cx - w / 2, cy - h / 2, w, h);
+						// the session may have ended before its .done was written
+						if (claims) claims->finish(claim_key(fpaths[i]));
 					}
-					break;
+					if (dr_tracked.valid()) dr_tracked.get();
+					have_next = false;
+					continue;
 				}
-
-				case manipRect::ModeClicks::C_T:
+				prefetchedImg item = have_next ? std::move(item_next) : fetch_image(revisit ? nullptr : prefetcher.get(), fpaths, i);
+				have_next = false;
+				if (item.skipped || (item.img.empty() && !item.tiled))
 				{
-					// find the half height first
-					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
-					int h = rect_temp.height * 2;
-					int w = std::round(thisObj->aspect_ratio * static_cast<float>(h));
-					rect_cur = cv::Rect(thisObj->point1.x - w / 2, thisObj->point1.y - h / 2, w, h);
-					break;
+					if (item.skipped) skipped.push_back(i);
+					else
+					{
+						cout << "Could not read " << fpaths[i] << "; skipping" << endl;
+						if (claims) claims->finish(claim_key(fpaths[i])); // no other worker could either
+					}
+					if (dr_tracked.valid()) dr_tracked.get();
+					continue;
 				}
-
-				case manipRect::ModeClicks::C_R:
+				cout << "Annotating image: " << fpaths[i] << endl;
+				// a tiled image is read region by region, and only where needed,
+				// so it is annotated at full resolution even with a reduced preview
+				cv::Mat img = item.img;
+				cv::Size size_img = item.tiled ? item.tiled->size() : img.size();
+				std::vector<cv::Rect> dr_init = item.dr_proposed;
+				if (dr_tracked.valid()) dr_init = boxPropagator::merge(dr_tracked.get(), dr_init);
+				if (journal) dr_init = journal->begin_image(fpaths[i], dr_init);
+				getRect_obj.trace_image(trace_ptr, static_cast<long long>(i), dr_init.size());
 				{
-					// find half width first
-					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
-					int w = rect_temp.width * 2;
-					int h = std::round(static_cast<float>(w) / thisObj->aspect_ratio);
-					rect_cur = cv::Rect(thisObj->point1.x - w / 2, thisObj->point1.y - h / 2, w, h);
-					break;
+					latencyTrace::scope t(trace_ptr, "get_dr", static_cast<long long>(i));
+					dr = item.tiled ? getRect_obj.get_dr(*item.tiled, dr_init) : getRect_obj.get_dr(img, dr_init);
 				}
-
-				case manipRect::ModeClicks::C_L:
+				if (journal) journal->finish_image(fpaths[i], size_img, dr);
+				if (propagator && !revisit && i + 1 < fpaths.size() && !dr.empty() && same_sequence(fpaths[i], fpaths[i + 1]))
 				{
-					// find half width first
-					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
-					int w = rect_temp.width * 2;
-					int h = std::round(static_cast<float>(w) / thisObj->aspect_ratio);
-					rect_cur = cv::Rect(thisObj->point1.x - w / 2, thisObj->point1.y - h / 2, w, h);
-					break;
+					item_next = fetch_image(prefetcher.get(), fpaths, i + 1);
+					have_next = true;
+					const boxPropagator *prop = propagator.get();
+					cv::Mat img_next = item_next.img;
+					dr_tracked = std::async(std::launch::async, [prop, img, dr, img_next, trace_ptr, i]() {
+						latencyTrace::scope t(trace_ptr, "propagate", static_cast<long long>(i + 1));
+						return prop->propagate(img, dr, img_next); });
 				}
-
-				case manipRect::ModeClicks::C_B:
+				if (!fpath_record_dr.empty()) dr_all[i] = dr;
+				if (!fpath_record_events.empty()) events_all[i] = getRect_obj.get_events_recorded();
+				// the patch numbers are decided here, so the output does not
+				// depend on the order in which the background jobs finish. No
+				// negatives for a tiled image: sampling them needs a coverage
+				// map of the whole image.
+				bool negatives = sink_neg && !item.tiled;
+				int id_first_neg = counter_neg + 1;
+				if (negatives) counter_neg += sampler.get_n_per_image();
+				patchSink *sink_neg_ptr = negatives ? sink_neg.get() : nullptr;
+				if (pool_full && !item.tiled)
 				{
-					// find the half height first
-					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
-					int h = rect_temp.height * 2;
-					int w = std::round(thisObj->aspect_ratio * static_cast<float>(h));
-					rect_cur = cv::Rect(thisObj->point1.x - w / 2, thisObj->point1.y - h / 2, w, h);
-					break;
+					int id_first = counter + 1;
+					counter += n_ids(dr.size());
+					cout << "Obtained " << dr.size() << " patches." << endl;
+					std::string fpath = fpaths[i];
+					patchSink *sink_ptr = sink.get();
+					annotationJournal *journal_ptr = journal.get();
+					pool_full->submit([this, fpath, dr, id_first, sink_ptr, sink_neg_ptr, id_first_neg, i, journal_ptr, &store, &mtx_store]() {
+						process_image_full(fpath, dr, id_first, *sink_ptr, store, mtx_store, sink_neg_ptr, id_first_neg, i, journal_ptr); });
+					continue;
 				}
-
-				case manipRect::ModeClicks::T_B:
+				if (!fpath_store.empty())
 				{
-					// find the full height first
-					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
-					int h = rect_temp.height;
-					int w = std::round(thisObj->aspect_ratio * static_cast<float>(h));
-					rect_cur = cv::Rect((rect_temp.x + rect_temp.width / 2) - w / 2,
-						(rect_temp.y + rect_temp.height / 2) - h / 2, w, h);
-					break;
+					std::lock_guard<std::mutex> lock(mtx_store);
+					store.put(fpaths[i], size_img, dr);
 				}
-
-				case manipRect::ModeClicks::L_R:
+				cout << "Obtained " << dr.size() << " patches." << endl;
 				{
-					// find the full width first
-					cv::Rect rect_temp(thisObj->point1, thisObj->point2);
-					int w = rect_temp.width;
-					int h = std::round(static_cast<float>(w) / thisObj->aspect_ratio);
-					rect_cur = cv::Rect((rect_temp.x + rect_temp.width / 2) - w / 2,
-						(rect_temp.y + rect_temp.height / 2) - h / 2, w, h);
-					break;
+					latencyTrace::scope t(trace_ptr, "extract", static_cast<long long>(i));
+					if (item.tiled) put_patches(*sink, *item.tiled, dr, counter + 1);
+					else put_patches(*sink, img, dr, counter + 1);
+				}
+				counter += n_ids(dr.size());
+				if (negatives)
+					pool_neg->submit([this, img, dr, id_first_neg, i, sink_neg_ptr]() {
+						put_negatives(*sink_neg_ptr, img, dr, id_first_neg, i); });
+				if (pool_done)
+				{
+					// waiting for everything queued so far covers this image
+					std::string fpath = fpaths[i];
+					patchSink *sink_ptr = sink.get();
+					workerPool *pool_neg_ptr = negatives ? pool_neg.get() : nullptr;
+					annotationJournal *journal_ptr = journal.get();
+					pool_done->submit([this, fpath, size_img, sink_ptr, sink_neg_ptr, pool_neg_ptr, journal_ptr]() {
+						if (pool_neg_ptr) pool_neg_ptr->wait_idle();
+						mark_stored(fpath, size_img, *sink_ptr, sink_neg_ptr, journal_ptr); });
 				}
-
-				} // end switch		
-
-				cv::rectangle(thisObj->img_canvas, rect_cur, thisObj->color_rect, thisObj->thickness_rect);
-				cv::imshow(thisObj->name_win, thisObj->img_canvas);
-				thisObj->dr.push_back(rect_cur);
-				thisObj->firstClickDone = false;
 			}
-
-			// process first click; just display the current image + the initial point
-			// wait for the second click to form the rectangle
-			else
+			order.clear();
+			for (size_t k = 0; k < skipped.size(); k++)
 			{
-				thisObj->point1 = cv::Point(x, y);
-				cv::Mat img_temp = thisObj->img_canvas.clone();
-				cv::drawMarker(img_temp, thisObj->point1, thisObj->color_rect, 0, 20, 2, 8);
-				cv::imshow(thisObj->name_win, img_temp);
-				thisObj->firstClickDone = true;
+				std::string key = claim_key(fpaths[skipped[k]]);
+				if (!claims->is_done(key) && !claims->held_elsewhere(key)) order.push_back(skipped[k]);
 			}
+			skipped.clear();
+			if (!order.empty()) cout << "Revisiting " << order.size() << " images given back by other workers" << endl;
 		}
 
-		// ======================================================= //
-		// non-delete mode: case 2 (moving using right click & drag)
-		// ======================================================= //
-		if (event == CV_EVENT_RBUTTONDOWN && !thisObj->being_dragged && thisObj->val_trackbar == 0)
+		getRect_obj.set_journal(nullptr);
+		if (pool_full) pool_full->wait_idle();
+		if (pool_neg) pool_neg->wait_idle();
+		if (pool_done) pool_done->wait_idle();
+		if (!fpath_store.empty()) store.save(fpath_store);
+		if (!fpath_record_dr.empty()) getRect_replay::save_dr_all(fpath_record_dr, dr_all);
+		if (!fpath_record_events.empty()) getRect_replay::save_events_all(fpath_record_events, events_all);
+
+		sink->flush();
+		cout << "Wrote " << sink->get_n_written() << " patches";
+		if (sink->get_n_failed() > 0) cout << " (" << sink->get_n_failed() << " failed)";
+		if (sink->get_n_existing() > 0) cout << "; " << sink->get_n_existing() << " were already there";
+		cout << "." << endl;
+		if (sink_neg)
 		{
-			thisObj->point1 = cv::Point(x, y);
-			thisObj->being_dragged = true;
-			int idx_rect_sel = thisObj->find_nearest_rect(thisObj->point1);
-			thisObj->rect_dragged = thisObj->dr[idx_rect_sel];
-			thisObj->dr.erase(thisObj->dr.begin()+ idx_rect_sel);
-			thisObj->update_canvas();
+			sink_neg->flush();
+			cout << "Wrote " << sink_neg->get_n_written() << " negatives." << endl;
 		}
-
-		if (event == CV_EVENT_MOUSEMOVE && thisObj->being_dragged && thisObj->val_trackbar == 0)
+		if (trace)
 		{
-			cv::Mat img_temp = thisObj->img_canvas.clone();
-			cv::Point p = cv::Point(x, y);
-			cv::Rect rec_cur(p.x - thisObj->rect_dragged.width / 2, p.y - thisObj->rect_dragged.height / 2,
-				thisObj->rect_dragged.width, thisObj->rect_dragged.height);
-			cv::rectangle(img_temp, rec_cur, thisObj->color_rect, thisObj->thickness_rect);
-			cv::imshow(thisObj->name_win, img_temp);
+			trace->print_summary();
+			if (!fpath_trace.empty()) trace->save_csv(fpath_trace);
 		}
 
-		if (event == CV_EVENT_RBUTTONUP && thisObj->being_dragged && thisObj->val_trackbar == 0)
+	} // end method "annotate"
+
+	// whether two frames are of the same sequence, i.e. in the same directory
+	static bool same_sequence(const std::string &fpath_a, const std::string &fpath_b)
+	{
+		return std::filesystem::path(fpath_a).parent_path() == std::filesystem::path(fpath_b).parent_path();
+	}
+
+	// decode an image at full resolution, scale up to it the rectangles
+	// dr_preview annotated on its preview, and queue its patches to be
+	// written, numbered from id_first (and its negatives, numbered from
+	// id_first_neg, unless sink_neg is nullptr). Once they are written, the
+	// full size is recorded into journal, if any. A Deep Zoom image, whose
+	// rectangles are at full resolution already, is read region by region
+	// instead. Runs on a background thread.
+	void process_image_full(const std::string &fpath, const std::vector<cv::Rect> &dr_preview, int id_first,
+		patchSink &sink, annotationStore &store, std::mutex &mtx_store,
+		patchSink *sink_neg = nullptr, int id_first_neg = 1, uint64_t seed_neg = 0, annotationJournal *journal = nullptr)
+	{
+		long long id_trace = static_cast<long long>(seed_neg); // annotate() seeds with the image index
+		prefetchedImg item;
+		item.fpath = fpath;
+		if (item.open_tiled())
 		{
-			cv::Point p = cv::Point(x, y);
-			thisObj->being_dragged = false;
-			cv::Rect rec_cur(p.x - thisObj->rect_dragged.width / 2, p.y - thisObj->rect_dragged.height / 2,
-				thisObj->rect_dragged.width, thisObj->rect_dragged.height);
-			thisObj->dr.push_back(rec_cur);			
-			thisObj->update_canvas();
-			cv::imshow(thisObj->name_win, thisObj->img_canvas);
+			// only when resuming; tiled images have no negatives
+			cv::Size size_full = item.tiled->size();
+			if (!fpath_store.empty())
+			{
+				std::lock_guard<std::mutex> lock(mtx_store);
+				store.put(fpath, size_full, dr_preview);
+			}
+			put_patches(sink, *item.tiled, dr_preview, id_first);
+			mark_stored(fpath, size_full, sink, nullptr, journal);
+			return;
+		}
+		if (tileReader_dzi::is_dzi(fpath)) return; // it could not be opened
+		cv::Mat img_full;
+		{
+			latencyTrace::scope t(trace.get(), "full_decode", id_trace);
+			try { img_full = cv::imread(fpath); }
+			catch (const cv::Exception &e) { cout << "Failed to decode " << fpath << ": " << e.what() << endl; }
 		}
+		if (img_full.empty())
+		{
+			cout << "Could not read " << fpath << " at full resolution; its patches are skipped" << endl;
+			return;
+		}
+		std::vector<cv::Rect> dr_full = scale_rects(dr_preview, reduce_preview, img_full.size());
+		if (!fpath_store.empty())
+		{
+			std::lock_guard<std::mutex> lock(mtx_store);
+			store.put(fpath, img_full.size(), dr_full);
+		}
+		{
+			latencyTrace::scope t(trace.get(), "extract", id_trace);
+			for (size_t j = 0; j < dr_full.size(); j++)
+				if (dr_full[j].area() > 0)
+					sink.put(id_first + static_cast<int>(j), img_full(dr_full[j]));
+			int K = augmenter.n_variants();
+			if (K > 0)
+			{
+				int id_variants = id_first + static_cast<int>(dr_full.size());
+				std::vector<cv::Mat> variants = augmenter.make_variants(img_full, dr_full, id_variants);
+				for (size_t v = 0; v < variants.size(); v++)
+					if (dr_full[v / K].area() > 0)
+						sink.put(id_variants + static_cast<int>(v), variants[v]);
+			}
+		}
+		if (sink_neg)
+			put_negatives(*sink_neg, img_full, dr_full, id_first_neg, seed_neg);
+		mark_stored(fpath, img_full.size(), sink, sink_neg, journal);
+	}
 
+	// once the patches queued so far are written, record the image at fpath
+	// as done: its full size into journal, if any, and for the other workers
+	void mark_stored(const std::string &fpath, cv::Size size_full, patchSink &sink, patchSink *sink_neg, annotationJournal *journal)
+	{
+		if (!journal && !claims) return;
+		sink.wait_stored();
+		if (sink_neg) sink_neg->wait_stored();
+		if (journal) journal->set_size_full(fpath, size_full);
+		if (claims) claims->finish(claim_key(fpath));
 	}
 
-	static void CallBackFunc_trackbar(int pos, void* userdata)
+	// write the patches of every image in the annotation store at fpath_store_
+	// to dir_output, without the GUI. Images are processed in the sorted
+	// order of their paths and patches are numbered as in annotate().
+	void extract_from_store(const std::string &fpath_store_)
 	{
-		manipRect* thisObj = static_cast<manipRect*>(userdata);
-		thisObj->val_trackbar = pos;
+		annotationStore store(fpath_store_);
+		std::vector<std::string> fpaths = store.image_paths();
+		cout << "Number of images in the annotation store = " << fpaths.size() << endl;
+
+		std::unique_ptr<imgPrefetcher> prefetcher;
+		if (n_prefetch > 0)
+			prefetcher.reset(new imgPrefetcher(fpaths, n_prefetch, n_threads_prefetch));
+		std::unique_ptr<patchSink> sink = make_sink();
+
+		std::vector<cv::Rect> dr;
+		int counter = 0;
+		for (size_t i = 0; i < fpaths.size(); i++)
+		{
+			prefetchedImg item;
+			if (prefetcher) item = prefetcher->get(i);
+			else
+			{
+				item.fpath = fpaths[i];
+				if (!item.open_tiled()) item.img = cv::imread(fpaths[i]);
+			}
+			if (item.img.empty() && !item.tiled)
+			{
+				cout << "Could not read " << fpaths[i] << "; skipping" << endl;
+				continue;
+			}
+			store.get(fpaths[i], dr);
+			if (item.tiled) put_patches(*sink, *item.tiled, dr, counter + 1);
+			else put_patches(*sink, item.img, dr, counter + 1);
+			counter += n_ids(dr.size());
+		}
+
+		sink->flush();
+		cout << "Wrote " << sink->get_n_written() << " patches";
+		if (sink->get_n_existing() > 0) cout << "; " << sink->get_n_existing() << " were already there";
+		cout << "." << endl;
 	}
 
 };
 
+// The benchmark below, and the counting of allocations it needs, is only
+// compiled into a build made with ANNOTATION_BENCHMARK defined, so that the
+// annotator itself keeps the standard operator new.
+#ifdef ANNOTATION_BENCHMARK
 
-// annotate object detection dataset
-class annotate_obj_det_dataset
+// every allocation made through operator new (vectors growing, strings,
+// ...) is counted, so that annotationBenchmark can report allocations per
+// event. Counting is a relaxed atomic increment.
+static std::atomic<long long> n_allocs_heap(0);
+
+void* operator new(std::size_t n)
+{
+	n_allocs_heap.fetch_add(1, std::memory_order_relaxed);
+	void *p = std::malloc(n > 0 ? n : 1);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+// OpenCV allocates the pixels of a cv::Mat with its own allocator rather
+// than operator new; installed as the default allocator, this one counts
+// those allocations and otherwise leaves everything to the standard one.
+class countingMatAllocator : public cv::MatAllocator
 {
+public:
+	countingMatAllocator() : n_allocs(0), base(cv::Mat::getStdAllocator()) {}
+
+	cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+		int flags, cv::UMatUsageFlags usageFlags) const override
+	{
+		n_allocs.fetch_add(1, std::memory_order_relaxed);
+		return base->allocate(dims, sizes, type, data, step, flags, usageFlags);
+	}
+	bool allocate(cv::UMatData* data, int accessflags, cv::UMatUsageFlags usageFlags) const override
+	{
+		return base->allocate(data, accessflags, usageFlags);
+	}
+	void deallocate(cv::UMatData* data) const override { base->deallocate(data); }
+
+	mutable std::atomic<long long> n_allocs;
+
 private:
-	cv::Size winsize; // detection window size
-	std::string dir_images, dir_output;
-	getRect_user &getRect_obj;
+	cv::MatAllocator *base;
+};
 
+// drives every getRect_user implementation without a window (headless, so
+// cv::imshow is skipped but all the drawing is done) with scripted mouse
+// events on synthetic images from VGA to 8K, and reports for each scenario
+// the latency of the events, as the highgui callbacks take them, and the
+// allocations made per event. n_boxes is the number of rectangles drawn,
+// or for the moves and deletes of manipRect the number already there.
+// Started by running a build made with ANNOTATION_BENCHMARK defined with
+// --benchmark [fpath_csv]; the rows are also written to fpath_csv, to
+// compare runs.
+class annotationBenchmark
+{
 public:
 
-	// make sure that "dir_images_" has "/" at the end
-	annotate_obj_det_dataset(std::string dir_images_, std::string dir_output_, 
-		const cv::Size &winsize_, getRect_user &getRect_obj_)
-		: getRect_obj(getRect_obj_)
+	annotationBenchmark(uint64_t seed_ = 1)
 	{
-		dir_images = dir_images_;
-		dir_output = dir_output_;
-		winsize = winsize_;		
+		seed = seed_;
+		sizes = { cv::Size(640, 480), cv::Size(1280, 720), cv::Size(1920, 1080),
+			cv::Size(3840, 2160), cv::Size(7680, 4320) };
+		n_boxes_all = { 10, 100, 1000, 10000 };
+		n_moves_drag = 8;
+	}
 
-		if (dir_images[dir_images.size() - 1] != '/')
+	void set_sizes(const std::vector<cv::Size> &sizes_) { sizes = sizes_; }
+	void set_n_boxes(const std::vector<int> &n_boxes_all_) { n_boxes_all = n_boxes_all_; }
+
+	void run(const std::string &fpath_csv = "")
+	{
+		cv::MatAllocator *allocator_prev = cv::Mat::getDefaultAllocator();
+		cv::Mat::setDefaultAllocator(&mat_allocator);
+		if (!fpath_csv.empty())
 		{
-			printf("ERROR: dir_images_ must end with '/'\n");
-			throw std::runtime_error("");
+			csv.open(fpath_csv);
+			if (!csv.is_open())
+			{
+				printf("ERROR: could not create %s\n", fpath_csv.c_str());
+				throw std::runtime_error("");
+			}
+			csv << "impl,scenario,width,height,n_boxes,n_events,mean_us,p50_us,p99_us,max_us,heap_allocs_per_event,mat_allocs_per_event\n";
 		}
+		printf("%-18s %-12s %11s %7s %8s %9s %9s %9s %9s %8s %8s\n", "impl", "scenario", "size", "boxes", "events",
+			"mean_us", "p50_us", "p99_us", "max_us", "heap/ev", "mat/ev");
 
-		if (dir_output[dir_output.size() - 1] != '/')
+		for (size_t s = 0; s < sizes.size(); s++)
 		{
-			printf("ERROR: dir_output_ must end with '/'\n");
-			throw std::runtime_error("");
+			cv::Mat img(sizes[s], CV_8UC3);
+			cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+			for (size_t k = 0; k < n_boxes_all.size(); k++)
+				run_all(img, n_boxes_all[k]);
 		}
 
+		cv::Mat::setDefaultAllocator(allocator_prev);
+		if (csv.is_open()) csv.close();
 	}
 
-	// extract patches from a given image and vector of rectangles
-	std::vector<cv::Mat> extract_patches(const cv::Mat &img, const std::vector<cv::Rect> &recs)
+private:
+	uint64_t seed;
+	std::vector<cv::Size> sizes;
+	std::vector<int> n_boxes_all;
+	int n_moves_drag; // mouse moves between the press and the release of a drag
+	countingMatAllocator mat_allocator;
+	std::ofstream csv;
+
+	void run_all(const cv::Mat &img, int n)
 	{
-		std::vector<cv::Mat> patches(recs.size());
-		for (int i = 0; i < recs.size(); i++)
-			patches[i] = img(recs[i]);
-		return patches;
+		cv::Size size = img.size();
+		std::vector<cv::Rect> dr = random_rects(size, n, seed);
+
+		getRect_1click_drag gr_drag;
+		run_events("getRect_1click_drag", "drag", gr_drag, img, std::vector<cv::Rect>(), n, script_drags(dr, CV_EVENT_LBUTTONDOWN, CV_EVENT_LBUTTONUP));
+
+		getRect_2clicks gr_2clicks(0);
+		run_events("getRect_2clicks", "2clicks", gr_2clicks, img, std::vector<cv::Rect>(), n, script_drags(dr, CV_EVENT_LBUTTONUP, CV_EVENT_LBUTTONUP));
+
+		getRect_1click gr_1click(cv::Size(32, 32));
+		run_events("getRect_1click", "click", gr_1click, img, std::vector<cv::Rect>(), n, script_clicks(dr, CV_EVENT_LBUTTONUP));
+
+		getRect_outLine gr_outline(cv::Size(32, 32));
+		gr_outline.set_max_fps(0);
+		run_events("getRect_outLine", "stroke", gr_outline, img, std::vector<cv::Rect>(), n, script_strokes(dr));
+
+		manipRect gr_manip(0);
+		run_events("manipRect", "add", gr_manip, img, std::vector<cv::Rect>(), n, script_drags(dr, CV_EVENT_LBUTTONUP, CV_EVENT_LBUTTONUP));
+		run_events("manipRect", "move", gr_manip, img, dr, n, script_moves(dr, std::min(n, 100), size));
+		run_events("manipRect", "delete", gr_manip, img, dr, n, script_deletes(dr, std::min(n, 100)));
+		run_events("manipRect", "mass_delete", gr_manip, img, dr, n, script_mass_deletes(size, 4));
 	}
 
-	void annotate()
+	// time every event of events fed to gr, after resetting it with img and dr_init
+	void run_events(const char *name_impl, const char *name_scenario, getRect_user &gr, const cv::Mat &img,
+		const std::vector<cv::Rect> &dr_init, int n_boxes, const std::vector<mouseEvent> &events)
 	{
-		// read in image full paths
-		std::vector<std::string> str_exts = { "*.png", "*.jpg", "*.jpeg", "*.tif", "*.tiff" };
-		std::vector<std::string> fpaths;
-		dir_fnames(dir_images, str_exts, fpaths);
-		cout << "Number of images to annotate = " << fpaths.size() << endl;
+		gr.set_headless(true);
+		gr.reset(img, dr_init);
+		std::vector<double> us(events.size());
+		long long n_heap = n_allocs_heap.load(), n_mat = mat_allocator.n_allocs.load();
+		for (size_t i = 0; i < events.size(); i++)
+		{
+			latencyTrace::clock::time_point t = latencyTrace::clock::now();
+			gr.feed_event(events[i].event, events[i].x, events[i].y, events[i].flags);
+			us[i] = std::chrono::duration<double, std::micro>(latencyTrace::clock::now() - t).count();
+		}
+		double heap_per_event = double(n_allocs_heap.load() - n_heap) / std::max(events.size(), size_t(1));
+		double mat_per_event = double(mat_allocator.n_allocs.load() - n_mat) / std::max(events.size(), size_t(1));
+		if (events.empty()) return;
 
-		cv::Mat img;
-		std::vector<cv::Mat> patches;
-		std::vector<cv::Rect> dr;
-		std::string fname_out;
-		int counter = 0;
+		std::sort(us.begin(), us.end());
+		double sum = 0;
+		for (size_t i = 0; i < us.size(); i++) sum += us[i];
+		double mean = sum / us.size(), p50 = latencyTrace::percentile(us, 50), p99 = latencyTrace::percentile(us, 99);
+		std::string str_size = fmt::sprintf("%dx%d", img.cols, img.rows);
+		printf("%-18s %-12s %11s %7d %8d %9.1f %9.1f %9.1f %9.1f %8.2f %8.2f\n", name_impl, name_scenario, str_size.c_str(),
+			n_boxes, static_cast<int>(events.size()), mean, p50, p99, us.back(), heap_per_event, mat_per_event);
+		if (csv.is_open())
+			csv << fmt::sprintf("%s,%s,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.4f,%.4f\n", name_impl, name_scenario, img.cols, img.rows,
+				n_boxes, events.size(), mean, p50, p99, us.back(), heap_per_event, mat_per_event);
+	}
 
-		// go through each image and annotate with bounding boxes
-		for (size_t i = 0; i < fpaths.size(); i++)
+	// n rectangles of 16 to 96 pixels a side, anywhere within size
+	static std::vector<cv::Rect> random_rects(const cv::Size &size, int n, uint64_t seed)
+	{
+		cv::RNG rng(seed);
+		std::vector<cv::Rect> dr(n);
+		for (int i = 0; i < n; i++)
 		{
-			cout << "Annotating image: " << fpaths[i] << endl;
-			img = cv::imread(fpaths[i]);
-			dr = getRect_obj.get_dr(img);
-			patches = extract_patches(img, dr);
-			cout << "Obtained " << patches.size() << " patches." << endl;
-			for (size_t j = 0; j < patches.size(); j++)
-			{
-				counter++;
-				fname_out = fmt::sprintf("%s%05d.png", dir_output, counter);
-				//cv::resize(patches[j], patches[j], winsize);
-				cv::imwrite(fname_out, patches[j]);
-			}
+			int w = std::min(rng.uniform(16, 97), size.width - 2), h = std::min(rng.uniform(16, 97), size.height - 2);
+			dr[i] = cv::Rect(rng.uniform(1, size.width - w), rng.uniform(1, size.height - h), w, h);
 		}
+		return dr;
+	}
 
-	
-	} // end method "annotate"
+	// press at the top left corner of each rectangle, move along the
+	// diagonal and release at the bottom right
+	std::vector<mouseEvent> script_drags(const std::vector<cv::Rect> &dr, int event_press, int event_release) const
+	{
+		std::vector<mouseEvent> events;
+		events.reserve(dr.size() * (n_moves_drag + 2));
+		for (size_t i = 0; i < dr.size(); i++)
+			push_drag(events, dr[i].tl(), dr[i].br(), event_press, event_release, CV_EVENT_FLAG_LBUTTON);
+		return events;
+	}
 
+	// a press at p1, n_moves_drag moves evenly spaced towards p2 and a release at p2
+	void push_drag(std::vector<mouseEvent> &events, const cv::Point &p1, const cv::Point &p2,
+		int event_press, int event_release, int flags_move) const
+	{
+		events.push_back(mouseEvent{ event_press, p1.x, p1.y, 0 });
+		for (int m = 1; m <= n_moves_drag; m++)
+			events.push_back(mouseEvent{ CV_EVENT_MOUSEMOVE, p1.x + (p2.x - p1.x) * m / (n_moves_drag + 1),
+				p1.y + (p2.y - p1.y) * m / (n_moves_drag + 1), flags_move });
+		events.push_back(mouseEvent{ event_release, p2.x, p2.y, 0 });
+	}
+
+	// one event at the centre of each rectangle
+	static std::vector<mouseEvent> script_clicks(const std::vector<cv::Rect> &dr, int event)
+	{
+		std::vector<mouseEvent> events;
+		events.reserve(dr.size());
+		for (size_t i = 0; i < dr.size(); i++)
+		{
+			cv::Point c = rectGrid::centre(dr[i]);
+			events.push_back(mouseEvent{ event, c.x, c.y, 0 });
+		}
+		return events;
+	}
+
+	// strokes of up to 32 points going through the centres of the rectangles
+	static std::vector<mouseEvent> script_strokes(const std::vector<cv::Rect> &dr)
+	{
+		const size_t n_stroke = 32;
+		std::vector<mouseEvent> events;
+		events.reserve(dr.size());
+		for (size_t i = 0; i < dr.size(); i++)
+		{
+			cv::Point c = rectGrid::centre(dr[i]);
+			bool first = i % n_stroke == 0, last = i % n_stroke == n_stroke - 1 || i + 1 == dr.size();
+			int event = first ? CV_EVENT_LBUTTONDOWN : (last ? CV_EVENT_LBUTTONUP : CV_EVENT_MOUSEMOVE);
+			events.push_back(mouseEvent{ event, c.x, c.y, CV_EVENT_FLAG_LBUTTON });
+		}
+		return events;
+	}
+
+	// right drags moving n_moves of the rectangles of dr by a quarter of
+	// their size
+	std::vector<mouseEvent> script_moves(const std::vector<cv::Rect> &dr, int n_moves, const cv::Size &size) const
+	{
+		std::vector<mouseEvent> events;
+		events.reserve(n_moves * (n_moves_drag + 2));
+		for (int i = 0; i < n_moves; i++)
+		{
+			cv::Point p1 = rectGrid::centre(dr[i]);
+			cv::Point p2(std::min(p1.x + dr[i].width / 4, size.width - 1), std::min(p1.y + dr[i].height / 4, size.height - 1));
+			push_drag(events, p1, p2, CV_EVENT_RBUTTONDOWN, CV_EVENT_RBUTTONUP, CV_EVENT_FLAG_RBUTTON);
+		}
+		return events;
+	}
+
+	// delete mode, then a right click on n_deletes of the rectangles of dr
+	static std::vector<mouseEvent> script_deletes(const std::vector<cv::Rect> &dr, int n_deletes)
+	{
+		std::vector<mouseEvent> events;
+		events.push_back(mouseEvent{ mouseEvent::EVENT_TRACKBAR, 1, 0, 0 });
+		for (int i = 0; i < n_deletes; i++)
+		{
+			cv::Point c = rectGrid::centre(dr[i]);
+			events.push_back(mouseEvent{ CV_EVENT_RBUTTONDOWN, c.x, c.y, 0 });
+		}
+		return events;
+	}
+
+	// delete mode, then n_boxes_del boxes, side by side across the image,
+	// each deleting all the rectangles with their centre inside
+	std::vector<mouseEvent> script_mass_deletes(const cv::Size &size, int n_boxes_del) const
+	{
+		std::vector<mouseEvent> events;
+		events.push_back(mouseEvent{ mouseEvent::EVENT_TRACKBAR, 1, 0, 0 });
+		for (int i = 0; i < n_boxes_del; i++)
+		{
+			cv::Point p1(size.width * i / n_boxes_del, 0), p2(size.width * (i + 1) / n_boxes_del - 1, size.height - 1);
+			push_drag(events, p1, p2, CV_EVENT_LBUTTONDOWN, CV_EVENT_LBUTTONUP, CV_EVENT_FLAG_LBUTTON);
+		}
+		return events;
+	}
 };
 
+#endif // ANNOTATION_BENCHMARK
+
 
 
 
 int main(int argc, char* argv[])
 {	
+#ifdef ANNOTATION_BENCHMARK
+	if (argc > 1 && std::string(argv[1]) == "--benchmark")
+	{
+		annotationBenchmark bench;
+		bench.run(argc > 2 ? argv[2] : "");
+		return 0;
+	}
+#endif
 
 	//cv::Mat img9 = cv::imread("D:/Research/Datasets/INRIAPerson_Piotr/Test/images/set01/V000/I00000.png");
 	//std::vector<cv::Rect> dr9 = getRect_1click_drag(img9).get_dr();